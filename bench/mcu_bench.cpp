@@ -0,0 +1,346 @@
+// Benchmarks for the main MCU interpreter. Each reports the cost per emulated
+// instruction of a hand-assembled loop, so nothing here needs ROMs.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <span>
+
+#include "nuked-sc55/emu.h"
+#include "nuked-sc55/mcu.h"
+#include "nuked-sc55/submcu.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ns(const Clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+//----------------------------------------------------------------------------
+// Main MCU
+
+struct ModelInfo {
+    const char* name;
+    Romset romset;
+};
+
+static constexpr ModelInfo Models[] = {
+    {"mk2", Romset::MK2},
+    {"mk1", Romset::MK1},
+    {"jv880", Romset::JV880},
+    {"scb55", Romset::SCB55},
+};
+
+// The romset flags as Emulator::LoadRoms sets them
+static void set_romset(Emulator& emu, const Romset romset)
+{
+    mcu_t& mcu = emu.GetMCU();
+
+    mcu.romset    = romset;
+    mcu.is_mk1    = romset == Romset::MK1;
+    mcu.is_jv880  = romset == Romset::JV880;
+    mcu.is_scb55  = romset == Romset::SCB55;
+    mcu.rom2_mask = mcu.is_jv880 ? ROM2_SIZE / 2 - 1 : ROM2_SIZE - 1;
+
+    MCU_SelectModel(mcu);
+    PCM_UpdateROMBanks(emu.GetPCM());
+}
+
+// Sums the words at 0x8000-0x80ff in place, calling a subroutine for each,
+// forever
+static constexpr uint8_t MCUProgram[] = {
+    0x5f, 0xd0, 0x00,       // 1000: mov:i.w #0xd000, r7
+    0x5a, 0x00, 0x03,       // 1003: mov:i.w #3, r2
+    0x59, 0x80, 0x00,       // 1006: mov:i.w #0x8000, r1
+    0xd9, 0x80,             // 1009: mov:g.w @r1, r0
+    0xaa, 0x20,             // 100b: add:g.w r2, r0
+    0xa8, 0x63,             // 100d: xor.w r0, r3
+    0xd9, 0x90,             // 100f: mov:g.w r0, @r1
+    0x0c, 0x00, 0x02, 0x21, // 1011: add:g.w #2, r1
+    0x0e, 0x07,             // 1015: bsr 101e
+    0x49, 0x81, 0x00,       // 1017: cmp:i.w #0x8100, r1
+    0x26, 0xed,             // 101a: bne 1009
+    0x20, 0xe8,             // 101c: bra 1006
+    0x54, 0x05,             // 101e: mov:e.b #5, r4
+    0xac, 0x73,             // 1020: cmp:g.w r4, r3
+    0x19,                   // 1022: rts
+};
+
+constexpr uint32_t MCUProgramStart = 0x1000;
+
+// Fills the ROMs with `program` at 0x1000 and every vector pointing at it,
+// or with random bytes and vectors if `program` is empty
+static std::unique_ptr<Emulator> make_mcu(const Romset romset,
+                                          std::span<const uint8_t> program,
+                                          const uint32_t seed)
+{
+    auto emu = std::make_unique<Emulator>();
+    emu->Init(EMU_Options{.enable_lcd = false});
+    set_romset(*emu, romset);
+
+    mcu_t& mcu = emu->GetMCU();
+    std::mt19937 rng(seed);
+
+    if (program.empty()) {
+        for (auto& val : mcu.rom1) {
+            val = rng();
+        }
+        for (auto& val : mcu.rom2) {
+            val = rng();
+        }
+        for (uint32_t i = 0; i < VECTOR_MAX; ++i) {
+            const uint32_t address = MCUProgramStart + (rng() & 0x3fff);
+            mcu.rom1[i * 4 + 2]    = (uint8_t)(address >> 8);
+            mcu.rom1[i * 4 + 3]    = (uint8_t)address;
+        }
+    } else {
+        std::copy(program.begin(), program.end(), &mcu.rom1[MCUProgramStart]);
+        for (uint32_t i = 0; i < VECTOR_MAX; ++i) {
+            mcu.rom1[i * 4 + 2] = (uint8_t)(MCUProgramStart >> 8);
+            mcu.rom1[i * 4 + 3] = (uint8_t)MCUProgramStart;
+        }
+    }
+
+    emu->Reset();
+    return emu;
+}
+
+// One MCU_Run call. With `batch` set the MCU runs `batch` instructions with
+// the PCM, timer and sub-MCU moved past the end of them, which leaves the
+// interpreter on its own; otherwise the peripherals run whenever they are due.
+template <typename Model>
+static void run_mcu(mcu_t& mcu, const uint64_t batch)
+{
+    if (batch) {
+        const uint64_t deadline = mcu.cycles + batch * 12;
+
+        mcu.next_event  = deadline;
+        mcu.timer_event = UINT64_MAX;
+        mcu.pcm->cycles = deadline;
+        mcu.sm->cycles  = deadline * 5;
+    }
+    MCU_RunModel<Model>(mcu);
+}
+
+// Cost per instruction of MCUProgram, see run_mcu for `batch`
+template <typename Model>
+static double time_mcu(const ModelInfo& model, const uint64_t batch)
+{
+    constexpr uint64_t Instructions = 2'000'000;
+
+    auto emu   = make_mcu(model.romset, MCUProgram, 0);
+    mcu_t& mcu = emu->GetMCU();
+
+    const uint64_t end = mcu.cycles + Instructions * 12;
+
+    const auto start = Clock::now();
+    while (mcu.cycles < end) {
+        run_mcu<Model>(mcu, batch);
+    }
+    return elapsed_ns(start) / Instructions;
+}
+
+template <typename Model>
+static void bench_mcu(const ModelInfo& model)
+{
+    for (const uint64_t batch : {0, 100'000}) {
+        // Keep the fastest of several runs, which takes out most of the
+        // noise of a shared machine
+        constexpr int Repeats = 7;
+        double best           = 0;
+
+        for (int repeat = 0; repeat < Repeats; ++repeat) {
+            const double ns = time_mcu<Model>(model, batch);
+            if (repeat == 0 || ns < best) {
+                best = ns;
+            }
+        }
+
+        printf("mcu %-5s, %s: %.2f ns/instruction\n", model.name,
+               batch ? "interpreter only" : "with peripherals", best);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Main MCU waiting, sleeping or polling, while the sub MCU interrupts it
+
+// Sleeps forever
+static constexpr uint8_t SleepProgram[] = {
+    0x1a,       // 1000: sleep
+    0x20, 0xfd, // 1001: bra 1000
+};
+
+// Waits for a flag in the FRT1 status register, counting them in r5
+static constexpr uint8_t PollProgram[] = {
+    0x15, 0xff, 0x91, 0x82,       // 1000: mov:g.b @0xff91, r2
+    0x04, 0x00, 0x72,             // 1004: cmp:g.b #0, r2
+    0x27, 0xf7,                   // 1007: beq 1000
+    0x15, 0xff, 0x91, 0x06, 0x00, // 1009: mov:g.b #0, @0xff91
+    0x0c, 0x00, 0x01, 0x25,       // 100e: add:g.w #1, r5
+    0x20, 0xec,                   // 1012: bra 1000
+};
+
+// Takes the GA interrupts, counting them in r3 and adding the sub MCU's
+// counter at the time to r4
+static constexpr uint8_t GAHandler[] = {
+    0x15, 0xe4, 0x02, 0x80, // 1100: mov:g.b @0xe402, r0
+    0x15, 0xec, 0x00, 0x81, // 1104: mov:g.b @0xec00, r1
+    0xa9, 0x24,             // 1108: add:g.w r1, r4
+    0x0c, 0x00, 0x01, 0x23, // 110a: add:g.w #1, r3
+    0x0a,                   // 110e: rte
+};
+
+constexpr uint32_t GAHandlerStart = 0x1100;
+
+// Raises and drops the UART3 line to the main MCU, which it sees as a GA
+// interrupt, counting in shared RAM through a delay loop after each
+static constexpr uint8_t SMProgram[] = {
+    0xa9, 0x80,       // 1000: lda #$80
+    0x85, 0xed,       // 1002: sta $ed
+    0xa2, 0xc0,       // 1004: ldx #$c0
+    0xee, 0x00, 0x02, // 1006: inc $0200
+    0xe8,             // 1009: inx
+    0xd0, 0xfa,       // 100a: bne 1006
+    0xa9, 0x00,       // 100c: lda #$00
+    0x85, 0xed,       // 100e: sta $ed
+    0xa2, 0xc0,       // 1010: ldx #$c0
+    0xee, 0x00, 0x02, // 1012: inc $0200
+    0xe8,             // 1015: inx
+    0xd0, 0xfa,       // 1016: bne 1012
+    0x4c, 0x00, 0x10, // 1018: jmp 1000
+};
+
+// `program` with GAHandler taking the GA interrupts, which the models with a
+// sub MCU get from SMProgram
+static std::unique_ptr<Emulator> make_waiting(const Romset romset, std::span<const uint8_t> program)
+{
+    auto emu     = make_mcu(romset, program, 0);
+    mcu_t& mcu   = emu->GetMCU();
+    submcu_t& sm = *mcu.sm;
+
+    std::copy(std::begin(GAHandler), std::end(GAHandler), &mcu.rom1[GAHandlerStart]);
+    mcu.rom1[VECTOR_IRQ1 * 4 + 2] = (uint8_t)(GAHandlerStart >> 8);
+    mcu.rom1[VECTOR_IRQ1 * 4 + 3] = (uint8_t)GAHandlerStart;
+
+    std::copy(std::begin(SMProgram), std::end(SMProgram), sm.rom);
+    for (uint32_t address = 0xfec; address < 0x1000; address += 2) {
+        sm.rom[address]     = 0x00;
+        sm.rom[address + 1] = 0x10;
+    }
+    emu->Reset();
+
+    // IRQ1 at level 1, everything unmasked
+    mcu.r[7]                     = 0xd000;
+    mcu.sr                       = 0;
+    mcu.dev_register[DEV_P1CR]  |= 0x40;
+    mcu.dev_register[DEV_IPRA]   = 0x01;
+    mcu.ga_int_enable            = 1 << 5;
+    return emu;
+}
+
+// The schedule without any fast-forwarding: a timer event due every step
+// makes the MCU service the peripherals after every instruction, so it never
+// skips idle steps or runs the sub MCU ahead. The timer catches up in closed
+// form, so the extra updates change nothing else.
+template <typename Model>
+static void run_lockstep(mcu_t& mcu)
+{
+    mcu.next_event  = mcu.cycles + 1;
+    mcu.timer_event = mcu.cycles + 1;
+    MCU_RunModel<Model>(mcu);
+}
+
+static bool same_state(mcu_t& a, mcu_t& b)
+{
+    const submcu_t& sa = *a.sm;
+    const submcu_t& sb = *b.sm;
+
+    return a.cycles == b.cycles && a.pc == b.pc && a.cp == b.cp &&
+           MCU_GetSR(a) == MCU_GetSR(b) && std::equal(std::begin(a.r), std::end(a.r), b.r) &&
+           a.sleep == b.sleep && a.interrupt_pending == b.interrupt_pending &&
+           sa.cycles == sb.cycles && sa.pc == sb.pc && sa.a == sb.a && sa.x == sb.x &&
+           sa.sr == sb.sr;
+}
+
+// Cost per main MCU step of `program`, run as usual and in lockstep, checking
+// both end up the same
+template <typename Model>
+static void bench_waiting(const ModelInfo& model, const char* name, std::span<const uint8_t> program)
+{
+    constexpr uint64_t Steps = 2'000'000;
+    constexpr int Repeats    = 7;
+    double best[2]           = {};
+
+    for (int repeat = 0; repeat < Repeats; ++repeat) {
+        auto emu        = make_waiting(model.romset, program);
+        auto ref        = make_waiting(model.romset, program);
+        mcu_t& mcu      = emu->GetMCU();
+        mcu_t& lockstep = ref->GetMCU();
+
+        const uint64_t begin = mcu.cycles;
+        const uint64_t end   = begin + Steps * 12;
+
+        auto start = Clock::now();
+        while (mcu.cycles < end) {
+            MCU_RunModel<Model>(mcu);
+        }
+        const double ns = elapsed_ns(start) / Steps;
+
+        start = Clock::now();
+        while (lockstep.cycles < mcu.cycles) {
+            run_lockstep<Model>(lockstep);
+        }
+        const double lockstep_ns = elapsed_ns(start) / Steps;
+
+        if (!same_state(mcu, lockstep)) {
+            fprintf(stderr, "mcu %s, %s: differs from lockstep\n", model.name, name);
+            exit(1);
+        }
+        if (repeat == 0 || ns < best[0]) {
+            best[0] = ns;
+        }
+        if (repeat == 0 || lockstep_ns < best[1]) {
+            best[1] = lockstep_ns;
+        }
+        if (repeat == 0) {
+            const uint64_t cycles = mcu.cycles - begin;
+            printf("mcu %-5s, %s: %u interrupts, %u flags, %.1f%% of cycles skipped in idle loops\n",
+                   model.name, name, (unsigned)mcu.r[3], (unsigned)mcu.r[5],
+                   100.0 * mcu.idle_cycles_skipped / cycles);
+        }
+    }
+
+    printf("mcu %-5s, %s: %.2f ns/step (lockstep: %.2f ns/step)\n", model.name, name, best[0],
+           best[1]);
+}
+
+template <typename Model>
+static void bench_mcu_waiting(const ModelInfo& model)
+{
+    if (Model::has_submcu) {
+        bench_waiting<Model>(model, "asleep", SleepProgram);
+    }
+    bench_waiting<Model>(model, "polling", PollProgram);
+}
+
+//----------------------------------------------------------------------------
+
+int main()
+{
+    bench_mcu<mcu_model_mk2_t>(Models[0]);
+    bench_mcu<mcu_model_mk1_t>(Models[1]);
+    bench_mcu<mcu_model_jv880_t>(Models[2]);
+    bench_mcu<mcu_model_scb55_t>(Models[3]);
+
+    bench_mcu_waiting<mcu_model_mk2_t>(Models[0]);
+    bench_mcu_waiting<mcu_model_mk1_t>(Models[1]);
+    bench_mcu_waiting<mcu_model_jv880_t>(Models[2]);
+    bench_mcu_waiting<mcu_model_scb55_t>(Models[3]);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define HALFBAND_SSE2
+#endif
+
+#include "halfband_decimator.h"
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser
+// window
+static double bessel_i0(const double x)
+{
+    double sum  = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+HalfBandDecimator::HalfBandDecimator()
+{
+    // Kaiser-windowed sinc with its cutoff at a quarter of the input rate.
+    // With 63 taps and beta 8 the response is flat to 0.2 of the input rate
+    // (12.8 kHz at 64 kHz) and down by 80 dB from 0.3.
+    constexpr double Beta    = 8.0;
+    constexpr auto NumTaps   = NumBranchTaps * 2 - 1;
+    constexpr auto CentreTap = static_cast<int>(NumTaps / 2);
+    constexpr double Pi      = 3.14159265358979323846;
+
+    std::array<double, NumBranchTaps> branch = {};
+    double sum = 0.0;
+
+    for (size_t j = 0; j < NumBranchTaps; ++j) {
+        const auto tap    = static_cast<int>(j * 2);
+        const auto offset = tap - CentreTap;
+
+        const double x      = Pi * offset / 2.0;
+        const double sinc   = std::sin(x) / x;
+        const double r      = 2.0 * tap / (NumTaps - 1) - 1.0;
+        const double window = bessel_i0(Beta * std::sqrt(1.0 - r * r)) /
+                              bessel_i0(Beta);
+
+        branch[j] = 0.5 * sinc * window;
+        sum += branch[j];
+    }
+
+    // The branch and the centre tap each contribute half of the DC gain
+    for (size_t j = 0; j < NumBranchTaps; ++j) {
+        const auto c = static_cast<float>(branch[j] * 0.5 / sum);
+
+        coeffs[j * 2]     = c;
+        coeffs[j * 2 + 1] = c;
+    }
+
+    Reset();
+}
+
+void HalfBandDecimator::Reset()
+{
+    branch_hist.fill(0.0f);
+    centre_hist.fill(0.0f);
+
+    branch_pos = 0;
+    centre_pos = 0;
+    odd_frame  = false;
+}
+
+bool HalfBandDecimator::Process(const float left, const float right,
+                                float& out_left, float& out_right)
+{
+    if (odd_frame) {
+        centre_hist[centre_pos * 2]     = left;
+        centre_hist[centre_pos * 2 + 1] = right;
+
+        centre_pos = (centre_pos + 1) % CentreDelay;
+        odd_frame  = false;
+        return false;
+    }
+    odd_frame = true;
+
+    branch_hist[branch_pos * 2]     = left;
+    branch_hist[branch_pos * 2 + 1] = right;
+
+    branch_hist[(branch_pos + NumBranchTaps) * 2]     = left;
+    branch_hist[(branch_pos + NumBranchTaps) * 2 + 1] = right;
+
+    branch_pos = (branch_pos + 1) % NumBranchTaps;
+
+    // The last NumBranchTaps even frames, oldest first. The filter is
+    // symmetric, so the coefficient order does not matter.
+    const float* window = &branch_hist[branch_pos * 2];
+
+#ifdef HALFBAND_SSE2
+    // Two frames of both channels per step
+    __m128 acc = _mm_setzero_ps();
+
+    for (size_t i = 0; i < NumBranchTaps * 2; i += 4) {
+        acc = _mm_add_ps(acc,
+                         _mm_mul_ps(_mm_loadu_ps(window + i),
+                                    _mm_load_ps(&coeffs[i])));
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, acc);
+
+    float sum_left  = lanes[0] + lanes[2];
+    float sum_right = lanes[1] + lanes[3];
+#else
+    float sum_left  = 0.0f;
+    float sum_right = 0.0f;
+
+    for (size_t i = 0; i < NumBranchTaps * 2; i += 2) {
+        sum_left += window[i] * coeffs[i];
+        sum_right += window[i + 1] * coeffs[i + 1];
+    }
+#endif
+
+    // The oldest odd frame sits exactly at the centre of the filter
+    out_left  = sum_left + 0.5f * centre_hist[centre_pos * 2];
+    out_right = sum_right + 0.5f * centre_hist[centre_pos * 2 + 1];
+
+    return true;
+}
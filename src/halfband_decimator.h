@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Halves the sample rate of a stereo stream with a linear-phase half-band
+// FIR filter. Every other tap of a half-band filter is zero apart from the
+// centre one, so only the even-indexed input frames go through the
+// multiply-accumulate; the odd ones just pass the centre tap after a delay.
+class HalfBandDecimator {
+public:
+    // Non-zero taps besides the centre one; the filter is
+    // 2 * NumBranchTaps - 1 taps long
+    static constexpr size_t NumBranchTaps = 32;
+
+    HalfBandDecimator();
+
+    void Reset();
+
+    // Feeds one input frame. Every second call produces an output frame and
+    // returns true.
+    bool Process(const float left, const float right, float& out_left,
+                 float& out_right);
+
+private:
+    static constexpr size_t CentreDelay = NumBranchTaps / 2;
+
+    // Branch coefficients, each repeated for the left and right channel
+    alignas(16) std::array<float, NumBranchTaps * 2> coeffs = {};
+
+    // Even-indexed input frames as interleaved L/R pairs. Stored twice so
+    // the last NumBranchTaps frames are always contiguous.
+    alignas(16) std::array<float, NumBranchTaps * 2 * 2> branch_hist = {};
+    size_t branch_pos = 0;
+
+    // Odd-indexed input frames waiting for the centre tap
+    std::array<float, CentreDelay * 2> centre_hist = {};
+    size_t centre_pos = 0;
+
+    bool odd_frame = false;
+};
@@ -3,6 +3,11 @@
 #include "math_util.h"
 #include <cstddef>
 #include <cstdint>
+#include <span>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NUKED_SC55_AUDIO_SSE2
+#endif
 
 enum class AudioFormat
 {
@@ -39,3 +44,36 @@ inline void Normalize(const AudioFrame<int32_t>& in, AudioFrame<float>& out)
     out.left  = (float)in.left * DIV_REC;
     out.right = (float)in.right * DIV_REC;
 }
+
+// Normalizes a block of frames into separate left and right float buffers,
+// with the same scaling as Normalize
+inline void NormalizePlanar(std::span<const AudioFrame<int32_t>> in, float* out_left, float* out_right)
+{
+    constexpr float DIV_REC = 1.0f / 536870912.0f;
+
+    size_t i = 0;
+
+#ifdef NUKED_SC55_AUDIO_SSE2
+    static_assert(sizeof(AudioFrame<int32_t>) == 2 * sizeof(int32_t));
+
+    const int32_t* src = &in.data()->left;
+    const __m128 scale = _mm_set1_ps(DIV_REC);
+
+    // Four frames per step: two vectors of L/R pairs, split into a vector of
+    // lefts and a vector of rights
+    for (; i + 4 <= in.size(); i += 4)
+    {
+        const __m128 lo = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(src + i * 2)));
+        const __m128 hi = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(src + i * 2 + 4)));
+
+        _mm_storeu_ps(out_left + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), scale));
+        _mm_storeu_ps(out_right + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), scale));
+    }
+#endif
+
+    for (; i < in.size(); ++i)
+    {
+        out_left[i]  = (float)in[i].left * DIV_REC;
+        out_right[i] = (float)in[i].right * DIV_REC;
+    }
+}
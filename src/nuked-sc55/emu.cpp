@@ -78,6 +78,13 @@ void Emulator::SetSampleCallback(mcu_sample_callback callback, void* userdata)
     m_mcu->sample_callback = callback;
 }
 
+void Emulator::SetSampleSink(std::span<AudioFrame<int32_t>> frames)
+{
+    m_mcu->sample_sink = frames.data();
+    m_mcu->sample_sink_capacity = frames.size();
+    m_mcu->sample_sink_count = 0;
+}
+
 const char* rs_name[(size_t)ROMSET_COUNT] = {
     "SC-55mk2",
     "SC-55st",
@@ -301,6 +308,8 @@ bool Emulator::LoadRoms(Romset romset, const std::filesystem::path& base_path)
             m_mcu->is_scb55 = true;
             break;
     }
+    MCU_SelectModel(*m_mcu);
+    PCM_UpdateROMBanks(*m_pcm);
 
     std::filesystem::path rpaths[ROM_SET_N_FILES];
 
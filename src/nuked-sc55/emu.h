@@ -65,6 +65,14 @@ public:
 
     void SetSampleCallback(mcu_sample_callback callback, void* userdata);
 
+    // Writes output frames straight into `frames` until it is full, after
+    // which they go to the sample callback again. Pass an empty span to
+    // detach the sink.
+    void SetSampleSink(std::span<AudioFrame<int32_t>> frames);
+
+    // Number of frames written to the sink since SetSampleSink
+    size_t GetSampleSinkCount() const { return m_mcu->sample_sink_count; }
+
     bool LoadRoms(Romset romset, const std::filesystem::path& base_path);
 
     void PostMIDI(uint8_t data_byte);
@@ -31,6 +31,8 @@
  *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  *  POSSIBILITY OF SUCH DAMAGE.
  */
+#include <algorithm>
+#include <iterator>
 #include "mcu.h"
 #include "mcu_timer.h"
 #include "mcu_opcodes.h"
@@ -160,17 +162,117 @@ void MCU_AnalogSample(mcu_t& mcu, int channel)
     mcu.dev_register[DEV_ADDRAL + dest] = (value << 6) & 0xc0;
 }
 
+// Maps the on-chip RAM at fb80-ff7f, which is only accessible while RAME is
+// set. The partial pages at both ends are left to MCU_ReadIO/MCU_WriteIO.
+static void MCU_MapRAM(mcu_t& mcu)
+{
+    const bool enabled = (mcu.dev_register[DEV_RAME] & 0x80) != 0;
+    for (uint32_t address = 0xfc00; address < 0xff00; address += 0x100)
+    {
+        uint8_t* ptr = enabled ? &mcu.ram[(address - 0xfb80) & 0x3ff] : nullptr;
+        mcu.read_map[address >> MCU_MAP_PAGE_SHIFT] = ptr;
+        mcu.write_map[address >> MCU_MAP_PAGE_SHIFT] = ptr;
+    }
+}
+
+void MCU_InitMemoryMap(mcu_t& mcu)
+{
+    for (uint32_t i = 0; i < MCU_MAP_PAGES; i++)
+    {
+        const uint32_t address = i << MCU_MAP_PAGE_SHIFT;
+        const uint32_t page = address >> 16;
+        const uint32_t offset = address & 0xffff;
+
+        uint32_t address_rom = address & 0x3ffff;
+        if (address & 0x80000 && !mcu.is_jv880)
+            address_rom |= 0x40000;
+        uint8_t* rom2 = &mcu.rom2[address_rom & mcu.rom2_mask];
+
+        uint8_t* read = nullptr;
+        uint8_t* write = nullptr;
+
+        switch (page)
+        {
+        case 0:
+            if (offset < 0x8000)
+                read = &mcu.rom1[offset];
+            else if (offset < 0xe000)
+                read = write = &mcu.sram[offset & 0x7fff];
+            break;
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+            read = rom2;
+            break;
+        case 8:
+        case 9:
+            if (!mcu.is_jv880)
+                read = rom2;
+            break;
+        case 14:
+        case 15:
+            if (!mcu.is_jv880)
+                read = rom2;
+            else
+            {
+                read = &mcu.cardram[offset & 0x7fff];
+                if (page == 14)
+                    write = read;
+            }
+            break;
+        case 10:
+        case 11:
+            if (!mcu.is_mk1)
+            {
+                read = &mcu.sram[offset & 0x7fff];
+                if (page == 10)
+                    write = read;
+            }
+            break;
+        case 12:
+        case 13:
+            if (mcu.is_jv880)
+            {
+                read = &mcu.nvram[offset & 0x7fff];
+                if (page == 12)
+                    write = read;
+            }
+            break;
+        case 5:
+            if (mcu.is_mk1)
+                read = write = &mcu.sram[offset & 0x7fff];
+            break;
+        default:
+            break;
+        }
+
+        mcu.read_map[i] = read;
+        mcu.write_map[i] = write;
+    }
+
+    for (uint32_t i = 0; i < VECTOR_MAX; i++)
+        mcu.vector_table[i] = MCU_Read32(mcu, i * 4);
+
+    MCU_MapRAM(mcu);
+}
+
 void MCU_DeviceWrite(mcu_t& mcu, uint32_t address, uint8_t data)
 {
     address &= 0x7f;
+    MCU_ScheduleUpdate(mcu);
     if (address >= 0x10 && address < 0x40)
     {
+        TIMER_Clock(*mcu.timer, mcu.cycles);
         TIMER_Write(*mcu.timer, address, data);
+        mcu.timer_event = 0;
         return;
     }
     if (address >= 0x50 && address < 0x55)
     {
+        TIMER_Clock(*mcu.timer, mcu.cycles);
         TIMER2_Write(*mcu.timer, address, data);
+        mcu.timer_event = 0;
         return;
     }
     switch (address)
@@ -279,17 +381,37 @@ void MCU_DeviceWrite(mcu_t& mcu, uint32_t address, uint8_t data)
         break;
     }
     mcu.dev_register[address] = data;
+    if (address == DEV_RAME)
+        MCU_MapRAM(mcu);
+    else if (address == DEV_P1CR || (address >= DEV_IPRA && address <= DEV_IPRD))
+        MCU_Interrupt_Update(mcu);
 }
 
+// Notes that repeating the current read returns the same value, with no
+// further side effects, until `cycles`. See MCU_SkipIdleLoop.
+static void MCU_ReadStableUntil(mcu_t& mcu, uint64_t cycles)
+{
+    if (cycles <= mcu.cycles)
+        mcu.side_effects++;
+    else if (cycles < mcu.read_stable_until)
+        mcu.read_stable_until = cycles;
+}
+
+// Registers not handled below only change through writes or when the
+// peripherals are serviced, and reading them again has no further effect.
 uint8_t MCU_DeviceRead(mcu_t& mcu, uint32_t address)
 {
     address &= 0x7f;
     if (address >= 0x10 && address < 0x40)
     {
+        TIMER_Clock(*mcu.timer, mcu.cycles);
+        MCU_ReadStableUntil(mcu, TIMER_ReadStableUntil(*mcu.timer, address));
         return TIMER_Read(*mcu.timer, address);
     }
     if (address >= 0x50 && address < 0x55)
     {
+        TIMER_Clock(*mcu.timer, mcu.cycles);
+        MCU_ReadStableUntil(mcu, TIMER_ReadStableUntil(*mcu.timer, address));
         return TIMER_Read2(*mcu.timer, address);
     }
     switch (address)
@@ -310,6 +432,8 @@ uint8_t MCU_DeviceRead(mcu_t& mcu, uint32_t address)
         mcu.ssr_rd = mcu.dev_register[address];
         return mcu.dev_register[address];
     case DEV_RDR:
+        // the sub mcu may receive a byte at any time
+        mcu.side_effects++;
         return mcu.uart_rx_byte;
     case 0x00:
         return 0xff;
@@ -317,6 +441,8 @@ uint8_t MCU_DeviceRead(mcu_t& mcu, uint32_t address)
     {
         if (!mcu.is_jv880) return 0xff;
 
+        mcu.side_effects++; // buttons
+
         uint8_t data = 0xff;
         uint32_t button_pressed = mcu.button_pressed;
 
@@ -369,6 +495,7 @@ void MCU_DeviceReset(mcu_t& mcu)
     // mcu.dev_register[0x7c] = 0x87;
     mcu.dev_register[DEV_RAME] = 0x80;
     mcu.dev_register[DEV_SSR] = 0x80;
+    MCU_MapRAM(mcu);
 }
 
 void MCU_UpdateAnalog(mcu_t& mcu, uint64_t cycles)
@@ -404,8 +531,10 @@ void MCU_UpdateAnalog(mcu_t& mcu, uint64_t cycles)
         mcu.analog_end_time = 0;
 }
 
-uint8_t MCU_Read(mcu_t& mcu, uint32_t address)
+uint8_t MCU_ReadIO(mcu_t& mcu, uint32_t address)
 {
+    if ((address & 0xfff80) != 0xff80) // MCU_DeviceRead accounts for itself
+        mcu.side_effects++;
     uint32_t address_rom = address & 0x3ffff;
     if (address & 0x80000 && !mcu.is_jv880)
         address_rom |= 0x40000;
@@ -606,7 +735,7 @@ uint32_t MCU_Read32(mcu_t& mcu, uint32_t address)
     return (b0 << 24) + (b1 << 16) + (b2 << 8) + b3;
 }
 
-void MCU_Write(mcu_t& mcu, uint32_t address, uint8_t value)
+void MCU_WriteIO(mcu_t& mcu, uint32_t address, uint8_t value)
 {
     uint8_t page = (address >> 16) & 0xf;
     address &= 0xffff;
@@ -694,12 +823,14 @@ void MCU_Write(mcu_t& mcu, uint32_t address, uint8_t value)
                 else if (address == 0xf105)
                 {
                     LCD_Write(*mcu.lcd, 0, value);
-                    mcu.ga_lcd_counter = 500;
+                    mcu.ga_lcd_end_time = mcu.cycles + 500 * 12;
+                    MCU_ScheduleUpdate(mcu);
                 }
                 else if (address == 0xf104)
                 {
                     LCD_Write(*mcu.lcd, 1, value);
-                    mcu.ga_lcd_counter = 500;
+                    mcu.ga_lcd_end_time = mcu.cycles + 500 * 12;
+                    MCU_ScheduleUpdate(mcu);
                 }
                 else if (address == 0xf107)
                 {
@@ -773,6 +904,7 @@ bool MCU_Init(mcu_t& mcu, submcu_t& sm, pcm_t& pcm, mcu_timer_t& timer, lcd_t& l
     mcu.pcm = &pcm;
     mcu.timer = &timer;
     mcu.lcd = &lcd;
+    MCU_SelectModel(mcu);
     return true;
 }
 
@@ -795,6 +927,7 @@ void MCU_Reset(mcu_t& mcu)
     mcu.pc = 0;
 
     mcu.sr = 0x700;
+    mcu.flags_op = MCU_FLAGS_SR;
 
     mcu.cp = 0;
     mcu.dp = 0;
@@ -802,6 +935,8 @@ void MCU_Reset(mcu_t& mcu)
     mcu.tp = 0;
     mcu.br = 0;
 
+    MCU_InitMemoryMap(mcu);
+
     uint32_t reset_address = MCU_GetVectorAddress(mcu, VECTOR_RESET);
     mcu.cp = (reset_address >> 16) & 0xff;
     mcu.pc = reset_address & 0xffff;
@@ -809,6 +944,11 @@ void MCU_Reset(mcu_t& mcu)
     mcu.exception_pending = -1;
 
     MCU_DeviceReset(mcu);
+    MCU_Interrupt_Update(mcu);
+
+    mcu.next_event = 0;
+    mcu.timer_event = 0;
+    mcu.idle_loop.head = UINT32_MAX;
 
     if (mcu.is_mk1)
     {
@@ -820,6 +960,7 @@ void MCU_PostUART(mcu_t& mcu, uint8_t data)
 {
     mcu.uart_buffer[mcu.uart_write_ptr] = data;
     mcu.uart_write_ptr = (mcu.uart_write_ptr + 1) % uart_buffer_size;
+    MCU_ScheduleUpdate(mcu);
 }
 
 void MCU_UpdateUART_RX(mcu_t& mcu)
@@ -869,47 +1010,281 @@ void MCU_WorkThread_Unlock(mcu_t& mcu)
     mcu.work_thread_lock.unlock();
 }
 
-void MCU_Step(mcu_t& mcu)
+// Earliest cycle at which MCU_UpdateUART_RX/TX would do anything
+static uint64_t MCU_NextUARTEvent(const mcu_t& mcu)
 {
-    if (!mcu.ex_ignore)
-        MCU_Interrupt_Handle(mcu);
-    else
-        mcu.ex_ignore = 0;
+    uint64_t next = UINT64_MAX;
 
-    if (!mcu.sleep)
-        MCU_ReadInstruction(mcu);
+    if ((mcu.dev_register[DEV_SCR] & 16) != 0 && mcu.uart_write_ptr != mcu.uart_read_ptr
+        && (mcu.dev_register[DEV_SSR] & 0x40) == 0)
+        next = Min<uint64_t>(next, mcu.uart_rx_delay);
 
-    mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
+    if ((mcu.dev_register[DEV_SCR] & 32) != 0 && (mcu.dev_register[DEV_SSR] & 0x80) == 0)
+        next = Min<uint64_t>(next, mcu.uart_tx_delay);
 
-    // if (mcu.cycles % 24000000 == 0)
-    //     fprintf(stderr, "seconds: %i\n", (int)(mcu.cycles / 24000000));
+    return next;
+}
+
+// Earliest cycle at which MCU_UpdateAnalog would do anything
+static uint64_t MCU_NextAnalogEvent(const mcu_t& mcu)
+{
+    if (mcu.dev_register[DEV_ADCSR] & 0x20)
+        return mcu.analog_end_time == 0 ? 0 : mcu.analog_end_time + 1;
+    return mcu.analog_end_time == 0 ? UINT64_MAX : 0;
+}
+
+// Earliest cycle at which a peripheral other than the sub mcu needs servicing
+static uint64_t MCU_NextPeripheralEvent(const mcu_t& mcu)
+{
+    uint64_t next = mcu.pcm->cycles + 1;
+    next = Min<uint64_t>(next, mcu.timer_event);
+    next = Min<uint64_t>(next, MCU_NextAnalogEvent(mcu));
+    if (mcu.ga_lcd_end_time)
+        next = Min<uint64_t>(next, mcu.ga_lcd_end_time);
+    return next;
+}
+
+// Earliest cycle at which servicing the peripherals could change what an idle
+// loop reads. The PCM and the sub mcu only reach the MCU through interrupts
+// and through registers whose reads count as side effects.
+template <typename Model>
+static uint64_t MCU_NextIdleLoopEvent(const mcu_t& mcu)
+{
+    uint64_t next = Min<uint64_t>(mcu.timer_event, MCU_NextAnalogEvent(mcu));
+    if constexpr (!Model::has_submcu)
+        next = Min<uint64_t>(next, MCU_NextUARTEvent(mcu));
+    if (mcu.ga_lcd_end_time)
+        next = Min<uint64_t>(next, mcu.ga_lcd_end_time);
+    return next;
+}
 
-    PCM_Update(*mcu.pcm, mcu.cycles);
+// Services the peripherals whose deadline has passed and computes the next
+// deadline. Skipped updates are exactly the ones that would have been no-ops,
+// so the result is the same as updating everything after every instruction.
+template <typename Model>
+static void MCU_UpdatePeripherals(mcu_t& mcu)
+{
+    PCM_UpdateModel<Model>(*mcu.pcm, mcu.cycles);
 
-    TIMER_Clock(*mcu.timer, mcu.cycles);
+    if (mcu.cycles >= mcu.timer_event)
+    {
+        TIMER_Clock(*mcu.timer, mcu.cycles);
+        mcu.timer_event = TIMER_NextEventCycle(*mcu.timer);
+    }
 
-    if (!mcu.is_mk1 && !mcu.is_jv880 && !mcu.is_scb55)
+    constexpr bool has_submcu = Model::has_submcu;
+
+    if constexpr (has_submcu)
         SM_Update(*mcu.sm, mcu.cycles);
-    else
+    else if (mcu.cycles >= MCU_NextUARTEvent(mcu))
     {
         MCU_UpdateUART_RX(mcu);
         MCU_UpdateUART_TX(mcu);
     }
 
-    MCU_UpdateAnalog(mcu, mcu.cycles);
+    if (mcu.cycles >= MCU_NextAnalogEvent(mcu))
+        MCU_UpdateAnalog(mcu, mcu.cycles);
 
-    if (mcu.is_mk1)
+    if (mcu.ga_lcd_end_time && mcu.cycles >= mcu.ga_lcd_end_time)
+    {
+        mcu.ga_lcd_end_time = 0;
+        MCU_GA_SetGAInt(mcu, 1, 0);
+        MCU_GA_SetGAInt(mcu, 1, 1);
+    }
+
+    // the sub mcu runs in lockstep with the main one
+    const uint64_t next = has_submcu ? mcu.cycles + 1 : MCU_NextUARTEvent(mcu);
+    mcu.next_event = Min<uint64_t>(next, MCU_NextPeripheralEvent(mcu));
+}
+
+// The main MCU is asleep until the next peripheral event, but the sub MCU has
+// to keep running. It runs up to that event in one go, or up to the step in
+// which it wakes the main MCU; the caller then finishes that step as usual.
+static void MCU_SleepWithSubMCU(mcu_t& mcu)
+{
+    const uint64_t event = MCU_NextPeripheralEvent(mcu);
+    if (event <= mcu.cycles + 12)
+        return;
+
+    const uint64_t cycles = SM_UpdateUntilInterrupt(*mcu.sm, mcu.cycles, event);
+    mcu.cycles = mcu.interrupt_level > ((mcu.sr >> 8) & 7) ? cycles - 12 : cycles;
+}
+
+// With a sub mcu the peripherals are serviced after every instruction, to
+// keep it in lockstep. An idle loop does nothing the sub mcu can see, so the
+// sub mcu runs ahead over the iterations skipped instead, up to the step in
+// which it interrupts the main MCU. If that step falls inside an iteration,
+// its instructions up to there are run again without the sub mcu and false
+// is returned.
+static bool MCU_SkipIdleLoopWithSubMCU(mcu_t& mcu, uint64_t period, uint64_t end)
+{
+    const uint64_t cycles = mcu.cycles;
+    const uint64_t skip = (end - cycles - 1) / period * period;
+    if (skip == 0)
+        return true;
+
+    const uint64_t stop = SM_UpdateUntilInterrupt(*mcu.sm, cycles, cycles + skip + 1);
+    const uint64_t skipped = (stop - cycles) / period * period;
+    mcu.cycles += skipped;
+    mcu.idle_cycles_skipped += skipped;
+
+    if (mcu.cycles == stop)
+        return true;
+    while (mcu.cycles < stop)
+    {
+        mcu.ex_ignore = 0;
+        MCU_ReadInstruction(mcu);
+        mcu.cycles += 12;
+    }
+    return false;
+}
+
+// Firmware often spins in a short loop polling RAM or a status register for
+// a flag that an interrupt handler or a peripheral sets. Called after a
+// backward branch: if a full iteration since the last visit to this loop head
+// did no I/O other than reads of registers that stay the same, wrote no memory
+// and left the CPU state unchanged, every further iteration is identical until
+// the next peripheral event or change in those registers, so as many as fit
+// before it are skipped at once.
+template <typename Model>
+static void MCU_SkipIdleLoop(mcu_t& mcu)
+{
+    mcu_idle_loop_t& loop = mcu.idle_loop;
+    const uint32_t head = MCU_GetAddress(mcu.cp, mcu.pc);
+    const uint16_t sr = MCU_GetSR(mcu);
+
+    if (loop.head == head && loop.side_effects == mcu.side_effects &&
+        loop.sr == sr && loop.ex_ignore == mcu.ex_ignore &&
+        loop.dp == mcu.dp && loop.ep == mcu.ep && loop.tp == mcu.tp && loop.br == mcu.br &&
+        std::equal(std::begin(loop.r), std::end(loop.r), mcu.r) &&
+        mcu.interrupt_level <= ((sr >> 8) & 7))
     {
-        if (mcu.ga_lcd_counter)
+        const uint64_t period = mcu.cycles - loop.cycles;
+        const uint64_t next = Model::has_submcu ? MCU_NextPeripheralEvent(mcu) : mcu.next_event;
+        const uint64_t end = Min<uint64_t>(next, mcu.read_stable_until);
+
+        if (end > mcu.cycles)
         {
-            mcu.ga_lcd_counter--;
-            if (mcu.ga_lcd_counter == 0)
+            if constexpr (Model::has_submcu)
             {
-                MCU_GA_SetGAInt(mcu, 1, 0);
-                MCU_GA_SetGAInt(mcu, 1, 1);
+                if (!MCU_SkipIdleLoopWithSubMCU(mcu, period, end))
+                {
+                    loop.head = UINT32_MAX;
+                    return;
+                }
+            }
+            else
+            {
+                const uint64_t skip = (end - mcu.cycles - 1) / period * period;
+                mcu.cycles += skip;
+                mcu.idle_cycles_skipped += skip;
             }
         }
     }
+
+    loop.head = head;
+    loop.cycles = mcu.cycles;
+    loop.side_effects = mcu.side_effects;
+    std::copy(std::begin(mcu.r), std::end(mcu.r), loop.r);
+    loop.sr = sr;
+    loop.dp = mcu.dp;
+    loop.ep = mcu.ep;
+    loop.tp = mcu.tp;
+    loop.br = mcu.br;
+    loop.ex_ignore = mcu.ex_ignore;
+    mcu.read_stable_until = UINT64_MAX;
+}
+
+// Runs one instruction or sleep period. Returns true if the peripherals
+// were serviced.
+template <typename Model>
+static inline bool MCU_StepInline(mcu_t& mcu)
+{
+    const bool check_interrupts = !mcu.ex_ignore;
+    bool branched_back = false;
+
+    if (check_interrupts)
+        MCU_Interrupt_Handle(mcu);
+    else
+        mcu.ex_ignore = 0;
+
+    if (!mcu.sleep)
+    {
+        const uint16_t pc = mcu.pc;
+        const uint8_t cp = mcu.cp;
+        MCU_ReadInstruction(mcu);
+        branched_back = mcu.pc < pc && mcu.cp == cp;
+    }
+    else if (check_interrupts && mcu.next_event > mcu.cycles)
+    {
+        // Still asleep with no interrupt to take. Nothing can change until a
+        // peripheral raises one, so skip ahead to the step that services them.
+        if constexpr (Model::has_submcu)
+            MCU_SleepWithSubMCU(mcu);
+        else
+            mcu.cycles += (mcu.next_event - mcu.cycles - 1) / 12 * 12;
+    }
+
+    mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
+
+    // if (mcu.cycles % 24000000 == 0)
+    //     fprintf(stderr, "seconds: %i\n", (int)(mcu.cycles / 24000000));
+
+    if (mcu.cycles >= mcu.next_event)
+    {
+        // With a sub mcu that is every step, and the PCM is due every few
+        // dozen. Neither breaks an idle loop.
+        const bool loop_intact = mcu.cycles < MCU_NextIdleLoopEvent<Model>(mcu);
+
+        MCU_UpdatePeripherals<Model>(mcu);
+        if (!loop_intact)
+            mcu.idle_loop.head = UINT32_MAX;
+        else if (branched_back)
+            MCU_SkipIdleLoop<Model>(mcu);
+        return true;
+    }
+    if (branched_back)
+        MCU_SkipIdleLoop<Model>(mcu);
+    return false;
+}
+
+template <typename Model>
+void MCU_StepModel(mcu_t& mcu)
+{
+    MCU_StepInline<Model>(mcu);
+}
+
+template <typename Model>
+void MCU_RunModel(mcu_t& mcu)
+{
+#ifdef NUKED_SC55_BATCH_INTERPRETER
+    // Everything outside the MCU only changes when the peripherals are
+    // serviced, so the instructions up to that point run back to back
+    // without going through mcu.step.
+    while (!MCU_StepInline<Model>(mcu))
+    {
+    }
+#else
+    MCU_StepInline<Model>(mcu);
+#endif
+}
+
+template void MCU_StepModel<mcu_model_mk2_t>(mcu_t& mcu);
+template void MCU_StepModel<mcu_model_mk1_t>(mcu_t& mcu);
+template void MCU_StepModel<mcu_model_jv880_t>(mcu_t& mcu);
+template void MCU_StepModel<mcu_model_scb55_t>(mcu_t& mcu);
+
+template void MCU_RunModel<mcu_model_mk2_t>(mcu_t& mcu);
+template void MCU_RunModel<mcu_model_mk1_t>(mcu_t& mcu);
+template void MCU_RunModel<mcu_model_jv880_t>(mcu_t& mcu);
+template void MCU_RunModel<mcu_model_scb55_t>(mcu_t& mcu);
+
+void MCU_SelectModel(mcu_t& mcu)
+{
+    MCU_WithModel(mcu, [&](auto model) {
+        mcu.step = &MCU_StepModel<decltype(model)>;
+        mcu.run = &MCU_RunModel<decltype(model)>;
+    });
 }
 
 void MCU_PatchROM(mcu_t& mcu)
@@ -953,11 +1328,6 @@ void MCU_WriteP1(mcu_t& mcu, uint8_t data)
     mcu.p1_data = data;
 }
 
-void MCU_PostSample(mcu_t& mcu, const AudioFrame<int32_t>& frame)
-{
-    mcu.sample_callback(mcu.callback_userdata, frame);
-}
-
 void MCU_GA_SetGAInt(mcu_t& mcu, int line, int value)
 {
     // guesswork
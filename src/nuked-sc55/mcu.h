@@ -120,6 +120,15 @@ enum {
     STATUS_INT_MASK = 0x700
 };
 
+// How the N/Z/V/C bits of sr are derived from the deferred ALU state
+enum {
+    MCU_FLAGS_SR = 0, // up to date in sr
+    MCU_FLAGS_LOGIC, // N and Z from flags_t1, V cleared, C unchanged
+    MCU_FLAGS_TEST, // N and Z from flags_t1, V and C cleared
+    MCU_FLAGS_ADD, // flags_t1 + flags_t2 + flags_c_bit
+    MCU_FLAGS_SUB, // flags_t1 - flags_t2 - flags_c_bit
+};
+
 enum {
     VECTOR_RESET = 0,
     VECTOR_RESERVED1, // UNUSED
@@ -178,6 +187,7 @@ enum {
     VECTOR_INTERNAL_INTERRUPT_D8, // TXI
     VECTOR_INTERNAL_INTERRUPT_DC, // UNUSED
     VECTOR_INTERNAL_INTERRUPT_E0, // ADI
+    VECTOR_MAX
 };
 
 static const int ROM1_SIZE = 0x8000;
@@ -204,6 +214,34 @@ enum class Romset {
 
 constexpr size_t ROMSET_COUNT = 9;
 
+constexpr uint32_t MCU_MAP_PAGE_SHIFT = 8;
+constexpr uint32_t MCU_MAP_PAGES = 0x100000 >> MCU_MAP_PAGE_SHIFT;
+
+// CPU state at the head of a loop, see MCU_SkipIdleLoop
+struct mcu_idle_loop_t {
+    uint32_t head = UINT32_MAX; // cp:pc the backward branch went to
+    uint64_t cycles = 0;
+    uint32_t side_effects = 0;
+    uint16_t r[8]{};
+    uint16_t sr = 0;
+    uint8_t dp = 0, ep = 0, tp = 0, br = 0;
+    uint8_t ex_ignore = 0;
+};
+
+// Romset features that the hot paths branch on. MCU_Step and PCM_Update are
+// instantiated once per model so these checks fold away at compile time.
+template <bool MK1, bool JV880, bool SUBMCU>
+struct mcu_model_t {
+    static constexpr bool is_mk1 = MK1;
+    static constexpr bool is_jv880 = JV880;
+    static constexpr bool has_submcu = SUBMCU;
+};
+
+using mcu_model_mk2_t = mcu_model_t<false, false, true>; // SC-55mk2, SC-55ST, SC-155mk2
+using mcu_model_mk1_t = mcu_model_t<true, false, false>; // SC-55, CM-300/SCC-1, SC-155
+using mcu_model_jv880_t = mcu_model_t<false, true, false>;
+using mcu_model_scb55_t = mcu_model_t<false, false, false>; // SCB-55, RLP-3237
+
 typedef void(*mcu_sample_callback)(void* userdata, const AudioFrame<int32_t>& frame);
 
 void MCU_DefaultSampleCallback(void* userdata, const AudioFrame<int32_t>& frame);
@@ -212,14 +250,30 @@ struct mcu_t {
     uint16_t r[8]{};
     uint16_t pc = 0;
     uint16_t sr = 0;
+    // The last ALU operation's flag update is deferred until something reads
+    // N/Z/V/C. Use MCU_GetSR rather than sr for those bits.
+    uint8_t flags_op = MCU_FLAGS_SR;
+    uint8_t flags_siz = 0;
+    uint8_t flags_c_bit = 0;
+    int32_t flags_t1 = 0;
+    int32_t flags_t2 = 0;
     uint8_t cp = 0, dp = 0, ep = 0, tp = 0, br = 0;
     uint8_t sleep = 0;
     uint8_t ex_ignore = 0;
     int32_t exception_pending = 0;
-    uint8_t interrupt_pending[INTERRUPT_SOURCE_MAX]{};
-    uint8_t trapa_pending[16]{};
+    uint32_t interrupt_pending = 0; // bit per INTERRUPT_SOURCE_*
+    uint16_t trapa_pending = 0; // bit per TRAPA vector
+    // Highest priority level among pending requests, 8 if a TRAPA, exception
+    // or NMI is pending. Kept up to date by MCU_Interrupt_Update so that
+    // MCU_Interrupt_Handle only has to compare it against the sr mask.
+    uint8_t interrupt_level = 0;
     uint64_t cycles = 0;
 
+    // Cycle at which the peripherals next need servicing. MCU_Step only
+    // updates them once mcu.cycles reaches this deadline.
+    uint64_t next_event = 0;
+    uint64_t timer_event = 0;
+
     uint8_t rom1[ROM1_SIZE]{};
     uint8_t rom2[ROM2_SIZE]{};
     uint8_t ram[RAM_SIZE]{};
@@ -229,6 +283,24 @@ struct mcu_t {
 
     uint8_t dev_register[0x80]{};
 
+    // Host pointers for each 256 byte page of the address space. Pages left
+    // null are I/O or unmapped and go through MCU_ReadIO/MCU_WriteIO.
+    uint8_t* read_map[MCU_MAP_PAGES]{};
+    uint8_t* write_map[MCU_MAP_PAGES]{};
+
+    // Exception vectors read from rom1 by MCU_InitMemoryMap
+    uint32_t vector_table[VECTOR_MAX]{};
+
+    // Bumped by every memory write and every I/O access other than reads of
+    // device registers that stay the same for a while. A loop iteration that
+    // leaves it unchanged has only read RAM, ROM and such registers, and
+    // read_stable_until is the earliest cycle at which one of those changes.
+    uint32_t side_effects = 0;
+    uint64_t read_stable_until = UINT64_MAX;
+    mcu_idle_loop_t idle_loop;
+    // Cycles fast-forwarded over firmware polling loops
+    uint64_t idle_cycles_skipped = 0;
+
     uint16_t ad_val[4]{};
     uint8_t ad_nibble = 0;
     uint8_t sw_pos = 3;
@@ -261,7 +333,7 @@ struct mcu_t {
     int ga_int[8]{};
     int ga_int_enable = 0;
     int ga_int_trigger = 0;
-    int ga_lcd_counter = 0;
+    uint64_t ga_lcd_end_time = 0;
 
     std::atomic<uint32_t> button_pressed;
 
@@ -283,23 +355,89 @@ struct mcu_t {
     uint16_t operand_data = 0;
     uint8_t opcode_extended = 0;
 
+    // MCU_Step and MCU_Run instances for the loaded romset, see
+    // MCU_SelectModel
+    void (*step)(mcu_t& mcu) = nullptr;
+    void (*run)(mcu_t& mcu) = nullptr;
+
     void* callback_userdata = nullptr;
     mcu_sample_callback sample_callback = MCU_DefaultSampleCallback;
 
+    // While it has room, output frames are appended here instead of going
+    // through sample_callback. See Emulator::SetSampleSink.
+    AudioFrame<int32_t>* sample_sink = nullptr;
+    size_t sample_sink_capacity = 0;
+    size_t sample_sink_count = 0;
+
     std::mutex work_thread_lock;
 };
 
 bool MCU_Init(mcu_t& mcu, submcu_t& sm, pcm_t& pcm, mcu_timer_t& timer, lcd_t& lcd);
 void MCU_Reset(mcu_t& mcu);
 void MCU_PatchROM(mcu_t& mcu);
-void MCU_Step(mcu_t& mcu);
+
+// Calls `func` with the mcu_model_t matching the romset flags
+template <typename F>
+decltype(auto) MCU_WithModel(const mcu_t& mcu, F&& func)
+{
+    if (mcu.is_mk1)
+        return func(mcu_model_mk1_t{});
+    if (mcu.is_jv880)
+        return func(mcu_model_jv880_t{});
+    if (mcu.is_scb55)
+        return func(mcu_model_scb55_t{});
+    return func(mcu_model_mk2_t{});
+}
+
+template <typename Model>
+void MCU_StepModel(mcu_t& mcu);
+template <typename Model>
+void MCU_RunModel(mcu_t& mcu);
+
+// Picks the MCU_Step instance for the romset flags. Must be called after
+// they change.
+void MCU_SelectModel(mcu_t& mcu);
+
+inline void MCU_Step(mcu_t& mcu)
+{
+    mcu.step(mcu);
+}
+
+// Runs instructions up to and including the next peripheral update, which is
+// the earliest point at which output or outside state can change. Built
+// without NUKED_SC55_BATCH_INTERPRETER it runs a single MCU_Step.
+inline void MCU_Run(mcu_t& mcu)
+{
+    mcu.run(mcu);
+}
 
 void MCU_ErrorTrap(mcu_t& mcu);
 
-uint8_t MCU_Read(mcu_t& mcu, uint32_t address);
+void MCU_InitMemoryMap(mcu_t& mcu);
+
+uint8_t MCU_ReadIO(mcu_t& mcu, uint32_t address);
+void MCU_WriteIO(mcu_t& mcu, uint32_t address, uint8_t value);
+
+inline uint8_t MCU_Read(mcu_t& mcu, uint32_t address)
+{
+    const uint8_t* page = mcu.read_map[(address >> MCU_MAP_PAGE_SHIFT) & (MCU_MAP_PAGES - 1)];
+    if (page)
+        return page[address & 0xff];
+    return MCU_ReadIO(mcu, address);
+}
+
+inline void MCU_Write(mcu_t& mcu, uint32_t address, uint8_t value)
+{
+    uint8_t* page = mcu.write_map[(address >> MCU_MAP_PAGE_SHIFT) & (MCU_MAP_PAGES - 1)];
+    mcu.side_effects++;
+    if (page)
+        page[address & 0xff] = value;
+    else
+        MCU_WriteIO(mcu, address, value);
+}
+
 uint16_t MCU_Read16(mcu_t& mcu, uint32_t address);
 uint32_t MCU_Read32(mcu_t& mcu, uint32_t address);
-void MCU_Write(mcu_t& mcu, uint32_t address, uint8_t value);
 void MCU_Write16(mcu_t& mcu, uint32_t address, uint16_t value);
 
 inline uint32_t MCU_GetAddress(uint8_t page, uint16_t address) {
@@ -316,6 +454,13 @@ inline uint8_t MCU_ReadCodeAdvance(mcu_t& mcu) {
     return ret;
 }
 
+// Makes the next MCU_Step service all peripherals. Must be called whenever
+// something changes that may move one of their deadlines forward.
+inline void MCU_ScheduleUpdate(mcu_t& mcu)
+{
+    mcu.next_event = 0;
+}
+
 inline void MCU_SetRegisterByte(mcu_t& mcu, uint8_t reg, uint8_t val)
 {
     mcu.r[reg] = val;
@@ -323,7 +468,7 @@ inline void MCU_SetRegisterByte(mcu_t& mcu, uint8_t reg, uint8_t val)
 
 inline uint32_t MCU_GetVectorAddress(mcu_t& mcu, uint32_t vector)
 {
-    return MCU_Read32(mcu, vector * 4);
+    return mcu.vector_table[vector];
 }
 
 inline uint32_t MCU_GetPageForRegister(mcu_t& mcu, uint32_t reg)
@@ -335,6 +480,21 @@ inline uint32_t MCU_GetPageForRegister(mcu_t& mcu, uint32_t reg)
     return mcu.dp;
 }
 
+// Computes the deferred N/Z/V/C bits into sr
+void MCU_ApplyFlags(mcu_t& mcu);
+
+inline void MCU_UpdateFlags(mcu_t& mcu)
+{
+    if (mcu.flags_op != MCU_FLAGS_SR)
+        MCU_ApplyFlags(mcu);
+}
+
+inline uint16_t MCU_GetSR(mcu_t& mcu)
+{
+    MCU_UpdateFlags(mcu);
+    return mcu.sr;
+}
+
 inline void MCU_ControlRegisterWrite(mcu_t& mcu, uint32_t reg, uint32_t siz, uint32_t data)
 {
     if (siz)
@@ -343,6 +503,7 @@ inline void MCU_ControlRegisterWrite(mcu_t& mcu, uint32_t reg, uint32_t siz, uin
         {
             mcu.sr = (uint16_t)data;
             mcu.sr &= sr_mask;
+            mcu.flags_op = MCU_FLAGS_SR;
         }
         else if (reg == 5) // FIXME: undocumented
         {
@@ -368,6 +529,7 @@ inline void MCU_ControlRegisterWrite(mcu_t& mcu, uint32_t reg, uint32_t siz, uin
             mcu.sr &= ~0xff;
             mcu.sr |= data & 0xff;
             mcu.sr &= sr_mask;
+            mcu.flags_op = MCU_FLAGS_SR;
         }
         else if (reg == 3)
         {
@@ -399,7 +561,7 @@ inline uint32_t MCU_ControlRegisterRead(mcu_t& mcu, uint32_t reg, uint32_t siz)
     {
         if (reg == 0)
         {
-            ret = mcu.sr & sr_mask;
+            ret = MCU_GetSR(mcu) & sr_mask;
         }
         else if (reg == 5) // FIXME: undocumented
         {
@@ -423,7 +585,7 @@ inline uint32_t MCU_ControlRegisterRead(mcu_t& mcu, uint32_t reg, uint32_t siz)
     {
         if (reg == 1)
         {
-            ret = mcu.sr & sr_mask;
+            ret = MCU_GetSR(mcu) & sr_mask;
         }
         else if (reg == 3)
         {
@@ -452,6 +614,7 @@ inline uint32_t MCU_ControlRegisterRead(mcu_t& mcu, uint32_t reg, uint32_t siz)
 
 inline void MCU_SetStatus(mcu_t& mcu, uint32_t condition, uint32_t mask)
 {
+    MCU_UpdateFlags(mcu);
     if (condition)
         mcu.sr |= (uint16_t)mask;
     else
@@ -541,7 +704,16 @@ void MCU_GA_SetGAInt(mcu_t& mcu, int line, int value);
 
 void MCU_EncoderTrigger(mcu_t& mcu, int dir);
 
-void MCU_PostSample(mcu_t& mcu, const AudioFrame<int32_t>& frame);
+inline void MCU_PostSample(mcu_t& mcu, const AudioFrame<int32_t>& frame)
+{
+    if (mcu.sample_sink_count < mcu.sample_sink_capacity)
+    {
+        mcu.sample_sink[mcu.sample_sink_count++] = frame;
+        return;
+    }
+    mcu.sample_callback(mcu.callback_userdata, frame);
+}
+
 void MCU_PostUART(mcu_t& mcu, uint8_t data);
 
 void MCU_WorkThread_Lock(mcu_t& mcu);
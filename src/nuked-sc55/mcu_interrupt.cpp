@@ -31,6 +31,7 @@
  *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  *  POSSIBILITY OF SUCH DAMAGE.
  */
+#include <bit>
 #include <stdio.h>
 #include "mcu.h"
 #include "mcu_interrupt.h"
@@ -39,7 +40,7 @@ void MCU_Interrupt_Start(mcu_t& mcu, int32_t mask)
 {
     MCU_PushStack(mcu, mcu.pc);
     MCU_PushStack(mcu, mcu.cp);
-    MCU_PushStack(mcu, mcu.sr);
+    MCU_PushStack(mcu, MCU_GetSR(mcu));
     mcu.sr &= ~STATUS_T;
     if (mask >= 0)
     {
@@ -49,9 +50,77 @@ void MCU_Interrupt_Start(mcu_t& mcu, int32_t mask)
     mcu.sleep = 0;
 }
 
+// Level above any sr interrupt mask, used for requests that are always taken
+static const uint8_t INTERRUPT_LEVEL_ALWAYS = 8;
+
+struct interrupt_source_t {
+    int32_t vector;
+    uint8_t ipr; // dev_register holding the priority level
+    uint8_t ipr_shift;
+    uint8_t p1cr_enable; // P1CR bit that must be set, 0 if none
+};
+
+static const interrupt_source_t interrupt_sources[INTERRUPT_SOURCE_MAX] = {
+    { VECTOR_NMI, 0, 0, 0 }, // INTERRUPT_SOURCE_NMI, handled separately
+    { VECTOR_IRQ0, DEV_IPRA, 4, 0x20 },
+    { VECTOR_IRQ1, DEV_IPRA, 0, 0x40 },
+    { -1, 0, 0, 0 }, // INTERRUPT_SOURCE_FRT0_ICI
+    { VECTOR_INTERNAL_INTERRUPT_94, DEV_IPRB, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_98, DEV_IPRB, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_9C, DEV_IPRB, 4, 0 },
+    { -1, 0, 0, 0 }, // INTERRUPT_SOURCE_FRT1_ICI
+    { VECTOR_INTERNAL_INTERRUPT_A4, DEV_IPRB, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_A8, DEV_IPRB, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_AC, DEV_IPRB, 0, 0 },
+    { -1, 0, 0, 0 }, // INTERRUPT_SOURCE_FRT2_ICI
+    { VECTOR_INTERNAL_INTERRUPT_B4, DEV_IPRC, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_B8, DEV_IPRC, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_BC, DEV_IPRC, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_C0, DEV_IPRC, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_C4, DEV_IPRC, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_C8, DEV_IPRC, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_E0, DEV_IPRD, 0, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_D4, DEV_IPRD, 4, 0 },
+    { VECTOR_INTERNAL_INTERRUPT_D8, DEV_IPRD, 4, 0 },
+};
+
+// Priority level of a maskable source, 0 if it can never be taken
+static uint32_t MCU_Interrupt_GetLevel(const mcu_t& mcu, uint32_t source)
+{
+    const interrupt_source_t& src = interrupt_sources[source];
+    if (src.vector < 0)
+        return 0;
+    if (src.p1cr_enable && (mcu.dev_register[DEV_P1CR] & src.p1cr_enable) == 0)
+        return 0;
+    return (mcu.dev_register[src.ipr] >> src.ipr_shift) & 7;
+}
+
+void MCU_Interrupt_Update(mcu_t& mcu)
+{
+    if (mcu.trapa_pending || mcu.exception_pending >= 0 ||
+        (mcu.interrupt_pending & (1u << INTERRUPT_SOURCE_NMI)))
+    {
+        mcu.interrupt_level = INTERRUPT_LEVEL_ALWAYS;
+        return;
+    }
+    uint32_t level = 0;
+    for (uint32_t pending = mcu.interrupt_pending; pending; pending &= pending - 1)
+    {
+        const uint32_t source_level = MCU_Interrupt_GetLevel(mcu, std::countr_zero(pending));
+        if (source_level > level)
+            level = source_level;
+    }
+    mcu.interrupt_level = level;
+}
+
 void MCU_Interrupt_SetRequest(mcu_t& mcu, uint32_t interrupt, uint32_t value)
 {
-    mcu.interrupt_pending[interrupt] = value;
+    const uint32_t pending = value ? mcu.interrupt_pending | (1u << interrupt)
+                                   : mcu.interrupt_pending & ~(1u << interrupt);
+    if (pending == mcu.interrupt_pending)
+        return;
+    mcu.interrupt_pending = pending;
+    MCU_Interrupt_Update(mcu);
 }
 
 void MCU_Interrupt_Exception(mcu_t& mcu, uint32_t exception)
@@ -63,11 +132,13 @@ void MCU_Interrupt_Exception(mcu_t& mcu, uint32_t exception)
         return;
 #endif
     mcu.exception_pending = exception;
+    mcu.interrupt_level = INTERRUPT_LEVEL_ALWAYS;
 }
 
 void MCU_Interrupt_TRAPA(mcu_t& mcu, uint32_t vector)
 {
-    mcu.trapa_pending[vector] = 1;
+    mcu.trapa_pending |= 1 << vector;
+    mcu.interrupt_level = INTERRUPT_LEVEL_ALWAYS;
 }
 
 void MCU_Interrupt_StartVector(mcu_t& mcu, uint32_t vector, int32_t mask)
@@ -97,15 +168,17 @@ void MCU_Interrupt_Handle(mcu_t& mcu)
         return;
     }
 #endif
-    uint32_t i;
-    for (i = 0; i < 16; i++)
+    uint32_t mask = (mcu.sr >> 8) & 7;
+    if (mcu.interrupt_level <= mask)
+        return;
+
+    if (mcu.trapa_pending)
     {
-        if (mcu.trapa_pending[i])
-        {
-            mcu.trapa_pending[i] = 0;
-            MCU_Interrupt_StartVector(mcu, VECTOR_TRAPA_0 + i, -1);
-            return;
-        }
+        const uint32_t i = std::countr_zero(mcu.trapa_pending);
+        mcu.trapa_pending &= ~(1 << i);
+        MCU_Interrupt_Update(mcu);
+        MCU_Interrupt_StartVector(mcu, VECTOR_TRAPA_0 + i, -1);
+        return;
     }
     if (mcu.exception_pending >= 0)
     {
@@ -123,103 +196,23 @@ void MCU_Interrupt_Handle(mcu_t& mcu)
 
         }
         mcu.exception_pending = -1;
+        MCU_Interrupt_Update(mcu);
         return;
     }
-    if (mcu.interrupt_pending[INTERRUPT_SOURCE_NMI])
+    if (mcu.interrupt_pending & (1u << INTERRUPT_SOURCE_NMI))
     {
         // mcu.interrupt_pending[INTERRUPT_SOURCE_NMI] = 0;
         MCU_Interrupt_StartVector(mcu, VECTOR_NMI, 7);
         return;
     }
-    uint32_t mask = (mcu.sr >> 8) & 7;
-    for (i = INTERRUPT_SOURCE_NMI + 1; i < INTERRUPT_SOURCE_MAX; i++)
+    // Sources are taken in their fixed order, not by level
+    for (uint32_t pending = mcu.interrupt_pending; pending; pending &= pending - 1)
     {
-        int32_t vector = -1;
-        int32_t level = 0;
-        if (!mcu.interrupt_pending[i])
-            continue;
-        switch (i)
-        {
-            case INTERRUPT_SOURCE_IRQ0:
-                if ((mcu.dev_register[DEV_P1CR] & 0x20) == 0)
-                    continue;
-                vector = VECTOR_IRQ0;
-                level = (mcu.dev_register[DEV_IPRA] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_IRQ1:
-                if ((mcu.dev_register[DEV_P1CR] & 0x40) == 0)
-                    continue;
-                vector = VECTOR_IRQ1;
-                level = (mcu.dev_register[DEV_IPRA] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT0_OCIA:
-                vector = VECTOR_INTERNAL_INTERRUPT_94;
-                level = (mcu.dev_register[DEV_IPRB] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT0_OCIB:
-                vector = VECTOR_INTERNAL_INTERRUPT_98;
-                level = (mcu.dev_register[DEV_IPRB] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT0_FOVI:
-                vector = VECTOR_INTERNAL_INTERRUPT_9C;
-                level = (mcu.dev_register[DEV_IPRB] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT1_OCIA:
-                vector = VECTOR_INTERNAL_INTERRUPT_A4;
-                level = (mcu.dev_register[DEV_IPRB] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT1_OCIB:
-                vector = VECTOR_INTERNAL_INTERRUPT_A8;
-                level = (mcu.dev_register[DEV_IPRB] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT1_FOVI:
-                vector = VECTOR_INTERNAL_INTERRUPT_AC;
-                level = (mcu.dev_register[DEV_IPRB] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT2_OCIA:
-                vector = VECTOR_INTERNAL_INTERRUPT_B4;
-                level = (mcu.dev_register[DEV_IPRC] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT2_OCIB:
-                vector = VECTOR_INTERNAL_INTERRUPT_B8;
-                level = (mcu.dev_register[DEV_IPRC] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_FRT2_FOVI:
-                vector = VECTOR_INTERNAL_INTERRUPT_BC;
-                level = (mcu.dev_register[DEV_IPRC] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_TIMER_CMIA:
-                vector = VECTOR_INTERNAL_INTERRUPT_C0;
-                level = (mcu.dev_register[DEV_IPRC] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_TIMER_CMIB:
-                vector = VECTOR_INTERNAL_INTERRUPT_C4;
-                level = (mcu.dev_register[DEV_IPRC] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_TIMER_OVI:
-                vector = VECTOR_INTERNAL_INTERRUPT_C8;
-                level = (mcu.dev_register[DEV_IPRC] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_ANALOG:
-                vector = VECTOR_INTERNAL_INTERRUPT_E0;
-                level = (mcu.dev_register[DEV_IPRD] >> 0) & 7;
-                break;
-            case INTERRUPT_SOURCE_UART_RX:
-                vector = VECTOR_INTERNAL_INTERRUPT_D4;
-                level = (mcu.dev_register[DEV_IPRD] >> 4) & 7;
-                break;
-            case INTERRUPT_SOURCE_UART_TX:
-                vector = VECTOR_INTERNAL_INTERRUPT_D8;
-                level = (mcu.dev_register[DEV_IPRD] >> 4) & 7;
-                break;
-            default:
-                break;
-        }
-
-        if ((int32_t)mask < level)
+        const uint32_t i = std::countr_zero(pending);
+        const uint32_t level = MCU_Interrupt_GetLevel(mcu, i);
+        if (mask < level)
         {
-            // mcu.interrupt_pending[INTERRUPT_SOURCE_NMI] = 0;
-            MCU_Interrupt_StartVector(mcu, vector, level);
+            MCU_Interrupt_StartVector(mcu, interrupt_sources[i].vector, level);
             return;
         }
     }
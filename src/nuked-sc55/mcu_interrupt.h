@@ -41,6 +41,7 @@ void MCU_Interrupt_SetRequest(mcu_t& mcu, uint32_t interrupt, uint32_t value);
 void MCU_Interrupt_Exception(mcu_t& mcu, uint32_t exception);
 void MCU_Interrupt_TRAPA(mcu_t& mcu, uint32_t vector);
 void MCU_Interrupt_Handle(mcu_t& mcu);
+void MCU_Interrupt_Update(mcu_t& mcu);
 
 enum {
     INTERRUPT_SOURCE_NMI = 0,
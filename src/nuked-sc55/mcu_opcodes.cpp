@@ -36,7 +36,8 @@
 #include "mcu_opcodes.h"
 #include "mcu_interrupt.h"
 
-int32_t MCU_SUB_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
+// N/Z/V/C bits of t1 - t2 - c_bit
+static uint32_t MCU_SUB_Flags(int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
 {
     int32_t st1, st2;
     int32_t N, Z, C, V = 0;
@@ -78,15 +79,11 @@ int32_t MCU_SUB_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32
         if (st1 < INT8_MIN || st1 > INT8_MAX)
             V = 1;
     }
-    MCU_SetStatus(mcu, N, STATUS_N);
-    MCU_SetStatus(mcu, Z, STATUS_Z);
-    MCU_SetStatus(mcu, C, STATUS_C);
-    MCU_SetStatus(mcu, V, STATUS_V);
-
-    return t1;
+    return (N ? STATUS_N : 0) | (Z ? STATUS_Z : 0) | (V ? STATUS_V : 0) | (C ? STATUS_C : 0);
 }
 
-int32_t MCU_ADD_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
+// N/Z/V/C bits of t1 + t2 + c_bit
+static uint32_t MCU_ADD_Flags(int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
 {
     int32_t st1, st2;
     int32_t N, Z, C, V = 0;
@@ -128,12 +125,56 @@ int32_t MCU_ADD_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32
         if (st1 < INT8_MIN || st1 > INT8_MAX)
             V = 1;
     }
-    MCU_SetStatus(mcu, N, STATUS_N);
-    MCU_SetStatus(mcu, Z, STATUS_Z);
-    MCU_SetStatus(mcu, C, STATUS_C);
-    MCU_SetStatus(mcu, V, STATUS_V);
+    return (N ? STATUS_N : 0) | (Z ? STATUS_Z : 0) | (V ? STATUS_V : 0) | (C ? STATUS_C : 0);
+}
+
+static void MCU_DeferFlags(mcu_t& mcu, uint8_t op, int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
+{
+    mcu.flags_op = op;
+    mcu.flags_t1 = t1;
+    mcu.flags_t2 = t2;
+    mcu.flags_c_bit = (uint8_t)c_bit;
+    mcu.flags_siz = (uint8_t)siz;
+}
 
-    return t1;
+int32_t MCU_SUB_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
+{
+    MCU_DeferFlags(mcu, MCU_FLAGS_SUB, t1, t2, c_bit, siz);
+    return (t1 - t2 - c_bit) & (siz ? 0xffff : 0xff);
+}
+
+int32_t MCU_ADD_Common(mcu_t& mcu, int32_t t1, int32_t t2, int32_t c_bit, uint32_t siz)
+{
+    MCU_DeferFlags(mcu, MCU_FLAGS_ADD, t1, t2, c_bit, siz);
+    return (t1 + t2 + c_bit) & (siz ? 0xffff : 0xff);
+}
+
+void MCU_ApplyFlags(mcu_t& mcu)
+{
+    const int32_t t1 = mcu.flags_t1;
+    uint32_t flags = 0;
+    switch (mcu.flags_op)
+    {
+    case MCU_FLAGS_LOGIC:
+    case MCU_FLAGS_TEST:
+        if (t1 & (mcu.flags_siz ? 0x8000 : 0x80))
+            flags |= STATUS_N;
+        if (t1 == 0)
+            flags |= STATUS_Z;
+        if (mcu.flags_op == MCU_FLAGS_LOGIC)
+            flags |= mcu.sr & STATUS_C;
+        break;
+    case MCU_FLAGS_ADD:
+        flags = MCU_ADD_Flags(t1, mcu.flags_t2, mcu.flags_c_bit, mcu.flags_siz);
+        break;
+    case MCU_FLAGS_SUB:
+        flags = MCU_SUB_Flags(t1, mcu.flags_t2, mcu.flags_c_bit, mcu.flags_siz);
+        break;
+    default:
+        return;
+    }
+    mcu.sr = (mcu.sr & ~(STATUS_N | STATUS_Z | STATUS_V | STATUS_C)) | flags;
+    mcu.flags_op = MCU_FLAGS_SR;
 }
 
 void MCU_Operand_Nop(mcu_t& mcu, uint8_t operand)
@@ -252,6 +293,7 @@ void MCU_Jump_RTE(mcu_t& mcu, uint8_t operand)
 {
     (void)operand;
     mcu.sr = MCU_PopStack(mcu);
+    mcu.flags_op = MCU_FLAGS_SR;
     mcu.cp = (uint8_t)MCU_PopStack(mcu);
     mcu.pc = MCU_PopStack(mcu);
     mcu.ex_ignore = 1;
@@ -274,10 +316,11 @@ void MCU_Jump_Bcc(mcu_t& mcu, uint8_t operand)
     }
     cond = operand & 0x0f;
 
-    N = (mcu.sr & STATUS_N) != 0;
-    C = (mcu.sr & STATUS_C) != 0;
-    Z = (mcu.sr & STATUS_Z) != 0;
-    V = (mcu.sr & STATUS_V) != 0;
+    const uint16_t sr = cond >= 2 ? MCU_GetSR(mcu) : mcu.sr;
+    N = (sr & STATUS_N) != 0;
+    C = (sr & STATUS_C) != 0;
+    Z = (sr & STATUS_Z) != 0;
+    V = (sr & STATUS_V) != 0;
 
     switch (cond)
     {
@@ -433,7 +476,7 @@ void MCU_Jump_JMP(mcu_t& mcu, uint8_t operand)
         if (opcode == 0x17)
         {
             uint16_t disp = (int8_t)MCU_ReadCodeAdvance(mcu);
-            uint32_t Z = (mcu.sr & STATUS_Z) != 0;
+            uint32_t Z = (MCU_GetSR(mcu) & STATUS_Z) != 0;
             if (Z)
             {
                 mcu.r[reg]--;
@@ -456,7 +499,7 @@ void MCU_Jump_JMP(mcu_t& mcu, uint8_t operand)
         if (opcode == 0x17)
         {
             uint16_t disp = (int8_t)MCU_ReadCodeAdvance(mcu);
-            uint32_t Z = (mcu.sr & STATUS_Z) != 0;
+            uint32_t Z = (MCU_GetSR(mcu) & STATUS_Z) != 0;
             if (!Z)
             {
                 mcu.r[reg]--;
@@ -697,16 +740,19 @@ void MCU_Operand_General(mcu_t& mcu, uint8_t operand)
 
 void MCU_SetStatusCommon(mcu_t& mcu, uint32_t val, uint32_t siz)
 {
-    if (siz)
-        val &= 0xffff;
-    else
-        val &= 0xff;
-    if (siz)
-        MCU_SetStatus(mcu, val & 0x8000, STATUS_N);
-    else
-        MCU_SetStatus(mcu, val & 0x80, STATUS_N);
-    MCU_SetStatus(mcu, val == 0, STATUS_Z);
-    MCU_SetStatus(mcu, 0, STATUS_V);
+    // C is kept, so it has to be resolved if the pending update sets it
+    uint8_t op = MCU_FLAGS_LOGIC;
+    if (mcu.flags_op == MCU_FLAGS_TEST)
+        op = MCU_FLAGS_TEST;
+    else if (mcu.flags_op != MCU_FLAGS_LOGIC)
+        MCU_UpdateFlags(mcu);
+    MCU_DeferFlags(mcu, op, val & (siz ? 0xffff : 0xff), 0, 0, siz);
+}
+
+// MCU_SetStatusCommon that also clears C
+static void MCU_SetStatusTest(mcu_t& mcu, uint32_t val, uint32_t siz)
+{
+    MCU_DeferFlags(mcu, MCU_FLAGS_TEST, val & (siz ? 0xffff : 0xff), 0, 0, siz);
 }
 
 void MCU_Opcode_Short_NotImplemented(mcu_t& mcu, uint8_t opcode)
@@ -970,25 +1016,18 @@ void MCU_Opcode_CLR(mcu_t& mcu, uint8_t opcode, uint8_t opcode_reg)
     if (opcode_reg == 3 && mcu.operand_type != GENERAL_IMMEDIATE) // CLR
     {
         MCU_Operand_Write(mcu, 0);
-        MCU_SetStatus(mcu, 0, STATUS_N);
-        MCU_SetStatus(mcu, 1, STATUS_Z);
-        MCU_SetStatus(mcu, 0, STATUS_V);
-        MCU_SetStatus(mcu, 0, STATUS_C);
+        MCU_SetStatusTest(mcu, 0, mcu.operand_size);
     }
     else if (opcode_reg == 6 && mcu.operand_type != GENERAL_IMMEDIATE) // TST
     {
         uint32_t data = MCU_Operand_Read(mcu);
-        MCU_SetStatusCommon(mcu, data, mcu.operand_size);
-        MCU_SetStatus(mcu, 0, STATUS_C);
+        MCU_SetStatusTest(mcu, data, mcu.operand_size);
     }
     else if (opcode_reg == 2 && mcu.operand_type == GENERAL_DIRECT && mcu.operand_size == 0) // EXTU
     {
         uint32_t data = (uint8_t)mcu.r[mcu.operand_reg];
         mcu.r[mcu.operand_reg] = data;
-        MCU_SetStatus(mcu, 0, STATUS_N);
-        MCU_SetStatus(mcu, data == 0, STATUS_Z);
-        MCU_SetStatus(mcu, 0, STATUS_V);
-        MCU_SetStatus(mcu, 0, STATUS_C);
+        MCU_SetStatusTest(mcu, data, OPERAND_WORD);
     }
     else if (opcode_reg == 0 && mcu.operand_type == GENERAL_DIRECT && mcu.operand_size == 0) // SWAP
     {
@@ -1284,7 +1323,7 @@ void MCU_Opcode_SHLR(mcu_t& mcu, uint8_t opcode, uint8_t opcode_reg)
     else if (opcode_reg == 0x06 && mcu.operand_type != GENERAL_IMMEDIATE) // ROTXL
     {
         uint32_t data = MCU_Operand_Read(mcu);
-        uint32_t bit = (mcu.sr & STATUS_C) != 0;
+        uint32_t bit = (MCU_GetSR(mcu) & STATUS_C) != 0;
         uint32_t C;
         if (mcu.operand_size)
             C = (data & 0x8000) != 0;
@@ -1481,8 +1520,8 @@ void MCU_Opcode_ADDX(mcu_t& mcu, uint8_t opcode, uint8_t opcode_reg)
     (void)opcode;
     int32_t t1 = mcu.r[opcode_reg];
     int32_t t2 = MCU_Operand_Read(mcu);
-    int32_t C = (mcu.sr & STATUS_C) != 0;
-    int32_t Z = (mcu.sr & STATUS_Z) != 0;
+    int32_t C = (MCU_GetSR(mcu) & STATUS_C) != 0;
+    int32_t Z = (MCU_GetSR(mcu) & STATUS_Z) != 0;
     t1 = MCU_ADD_Common(mcu, t1, t2, C, mcu.operand_size);
     if (!Z)
         MCU_SetStatus(mcu, 0, STATUS_Z);
@@ -1501,7 +1540,7 @@ void MCU_Opcode_SUBX(mcu_t& mcu, uint8_t opcode, uint8_t opcode_reg)
     (void)opcode;
     int32_t t1 = mcu.r[opcode_reg];
     int32_t t2 = MCU_Operand_Read(mcu);
-    int32_t C = (mcu.sr & STATUS_C) != 0;
+    int32_t C = (MCU_GetSR(mcu) & STATUS_C) != 0;
     t1 = MCU_SUB_Common(mcu, t1, t2, C, mcu.operand_size);
     if (mcu.operand_size)
         mcu.r[opcode_reg] = t1;
@@ -226,81 +226,258 @@ constexpr uint64_t TIMER_STEP_TABLE_MK1[8] = {
     0, 7, 63, 1023, 0, 3, 3, 3
 };
 
+constexpr uint64_t TIMER_NO_EVENT = UINT64_MAX;
+
+// Number of counter steps until a counter at `value` equals `match`. The
+// counter wraps at `top`, or is cleared after it equals `clear` if `clearing`
+// is set.
+static uint64_t TIMER_StepsToMatch(uint32_t value, uint32_t match, uint32_t top, bool clearing, uint32_t clear)
+{
+    uint32_t steps = (match - value) & top;
+    if (clearing)
+    {
+        uint32_t clear_steps = (clear - value) & top;
+        if (steps > clear_steps)
+            return match <= clear ? clear_steps + 1 + match : TIMER_NO_EVENT;
+    }
+    return steps;
+}
+
+static uint64_t TIMER_StepsToOverflow(uint32_t value, uint32_t top, bool clearing, uint32_t clear)
+{
+    if (clearing && value <= clear)
+        return TIMER_NO_EVENT;
+    return top - value;
+}
+
+enum {
+    TIMER_EVENT_OVF = 1,
+    TIMER_EVENT_MATCHA = 2,
+    TIMER_EVENT_MATCHB = 4,
+};
+
+// Number of counter steps on timer cycles [from, to) for a counter that steps
+// on cycles that are a multiple of step_mask + 1
+static uint64_t TIMER_CountSteps(uint64_t from, uint64_t to, uint64_t step_mask)
+{
+    return (to + step_mask) / (step_mask + 1) - (from + step_mask) / (step_mask + 1);
+}
+
+// Advances a counter by `steps` and returns the TIMER_EVENT_* flags for the
+// overflows and compare matches on the way
+static uint32_t TIMER_Advance(uint32_t& value, uint64_t steps, uint32_t top, bool clearing, uint32_t clear,
+                              uint32_t match_a, uint32_t match_b)
+{
+    uint32_t events = 0;
+    if (TIMER_StepsToOverflow(value, top, clearing, clear) < steps)
+        events |= TIMER_EVENT_OVF;
+    if (TIMER_StepsToMatch(value, match_a, top, clearing, clear) < steps)
+        events |= TIMER_EVENT_MATCHA;
+    if (TIMER_StepsToMatch(value, match_b, top, clearing, clear) < steps)
+        events |= TIMER_EVENT_MATCHB;
+
+    const uint64_t clear_steps = clearing ? (uint64_t)((clear - value) & top) : TIMER_NO_EVENT;
+    if (steps <= clear_steps)
+        value = (uint32_t)((value + steps) & top);
+    else
+        value = (uint32_t)((steps - clear_steps - 1) % ((uint64_t)clear + 1));
+    return events;
+}
+
 void TIMER_Clock(mcu_timer_t& timer, uint64_t cycles)
 {
     const bool mk1 = timer.mcu->is_mk1;
     const auto& FRT_STEP_TABLE = mk1 ? FRT_STEP_TABLE_MK1 : FRT_STEP_TABLE_GENERIC;
     const auto& TIMER_STEP_TABLE = mk1 ? TIMER_STEP_TABLE_MK1 : TIMER_STEP_TABLE_GENERIC;
 
-    while (timer.cycles*2 < cycles) // FIXME
+    const uint64_t end = (cycles + 1) / 2; // FIXME
+    if (timer.cycles >= end)
+        return;
+
+    for (int i = 0; i < 3; i++)
     {
-        for (int i = 0; i < 3; i++)
-        {
-            frt_t *ftimer = &timer.frt[i];
-
-            const bool frt_step = !(timer.cycles & FRT_STEP_TABLE[ftimer->tcr & 3]);
-
-            if (frt_step)
-            {
-                uint32_t value = ftimer->frc;
-                uint32_t matcha = value == ftimer->ocra;
-                uint32_t matchb = value == ftimer->ocrb;
-                if ((ftimer->tcsr & 1) != 0 && matcha) // CCLRA
-                    value = 0;
-                else
-                    value++;
-                uint32_t of = (value >> 16) & 1;
-                value &= 0xffff;
-                ftimer->frc = value;
-
-                // flags
-                if (of)
-                    ftimer->tcsr |= 0x10;
-                if (matcha)
-                    ftimer->tcsr |= 0x20;
-                if (matchb)
-                    ftimer->tcsr |= 0x40;
-                if ((ftimer->tcr & 0x10) != 0 && (ftimer->tcsr & 0x10) != 0)
-                    MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_FOVI + i * 4, 1);
-                if ((ftimer->tcr & 0x20) != 0 && (ftimer->tcsr & 0x20) != 0)
-                    MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_OCIA + i * 4, 1);
-                if ((ftimer->tcr & 0x40) != 0 && (ftimer->tcsr & 0x40) != 0)
-                    MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_OCIB + i * 4, 1);
-            }
-        }
+        frt_t *ftimer = &timer.frt[i];
 
-        const bool timer_step = !(timer.cycles & TIMER_STEP_TABLE[timer.tcr & 7]);
+        const uint64_t steps = TIMER_CountSteps(timer.cycles, end, FRT_STEP_TABLE[ftimer->tcr & 3]);
+        if (steps == 0)
+            continue;
 
-        if (timer_step)
-        {
-            uint32_t value = timer.tcnt;
-            uint32_t matcha = value == timer.tcora;
-            uint32_t matchb = value == timer.tcorb;
-            if ((timer.tcr & 24) == 8 && matcha)
-                value = 0;
-            else if ((timer.tcr & 24) == 16 && matchb)
-                value = 0;
-            else
-                value++;
-            uint32_t of = (value >> 8) & 1;
-            value &= 0xff;
-            timer.tcnt = value;
-
-            // flags
-            if (of)
-                timer.tcsr |= 0x20;
-            if (matcha)
-                timer.tcsr |= 0x40;
-            if (matchb)
-                timer.tcsr |= 0x80;
-            if ((timer.tcr & 0x20) != 0 && (timer.tcsr & 0x20) != 0)
-                MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_OVI, 1);
-            if ((timer.tcr & 0x40) != 0 && (timer.tcsr & 0x40) != 0)
-                MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_CMIA, 1);
-            if ((timer.tcr & 0x80) != 0 && (timer.tcsr & 0x80) != 0)
-                MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_CMIB, 1);
-        }
+        uint32_t value = ftimer->frc;
+        const uint32_t events = TIMER_Advance(value, steps, 0xffff, (ftimer->tcsr & 1) != 0, // CCLRA
+                                              ftimer->ocra, ftimer->ocra, ftimer->ocrb);
+        ftimer->frc = value;
+
+        // flags
+        if (events & TIMER_EVENT_OVF)
+            ftimer->tcsr |= 0x10;
+        if (events & TIMER_EVENT_MATCHA)
+            ftimer->tcsr |= 0x20;
+        if (events & TIMER_EVENT_MATCHB)
+            ftimer->tcsr |= 0x40;
+        if ((ftimer->tcr & 0x10) != 0 && (ftimer->tcsr & 0x10) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_FOVI + i * 4, 1);
+        if ((ftimer->tcr & 0x20) != 0 && (ftimer->tcsr & 0x20) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_OCIA + i * 4, 1);
+        if ((ftimer->tcr & 0x40) != 0 && (ftimer->tcsr & 0x40) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_FRT0_OCIB + i * 4, 1);
+    }
+
+    const uint64_t steps = TIMER_CountSteps(timer.cycles, end, TIMER_STEP_TABLE[timer.tcr & 7]);
+    if (steps != 0)
+    {
+        const bool clra = (timer.tcr & 24) == 8;
+        const bool clrb = (timer.tcr & 24) == 16;
+        uint32_t value = timer.tcnt;
+        const uint32_t events = TIMER_Advance(value, steps, 0xff, clra || clrb, clra ? timer.tcora : timer.tcorb,
+                                              timer.tcora, timer.tcorb);
+        timer.tcnt = value;
+
+        // flags
+        if (events & TIMER_EVENT_OVF)
+            timer.tcsr |= 0x20;
+        if (events & TIMER_EVENT_MATCHA)
+            timer.tcsr |= 0x40;
+        if (events & TIMER_EVENT_MATCHB)
+            timer.tcsr |= 0x80;
+        if ((timer.tcr & 0x20) != 0 && (timer.tcsr & 0x20) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_OVI, 1);
+        if ((timer.tcr & 0x40) != 0 && (timer.tcsr & 0x40) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_CMIA, 1);
+        if ((timer.tcr & 0x80) != 0 && (timer.tcsr & 0x80) != 0)
+            MCU_Interrupt_SetRequest(*timer.mcu, INTERRUPT_SOURCE_TIMER_CMIB, 1);
+    }
+
+    timer.cycles = end;
+}
+
+// Counter step at which an interrupt source will next be (re)requested
+static uint64_t TIMER_SourceSteps(const mcu_timer_t& timer, int source, bool enabled, bool flag, uint64_t steps)
+{
+    if (!enabled)
+        return TIMER_NO_EVENT;
+    if (flag)
+        return (timer.mcu->interrupt_pending & (1u << source)) ? TIMER_NO_EVENT : 0;
+    return steps;
+}
+
+// Converts a counter step to the mcu cycle count that makes TIMER_Clock
+// process it
+static uint64_t TIMER_StepsToCycle(uint64_t timer_cycles, uint64_t step_mask, uint64_t steps)
+{
+    if (steps == TIMER_NO_EVENT)
+        return TIMER_NO_EVENT;
+    const uint64_t first = (timer_cycles + step_mask) & ~step_mask;
+    return (first + steps * (step_mask + 1)) * 2 + 1;
+}
 
-        timer.cycles++;
+uint64_t TIMER_NextEventCycle(const mcu_timer_t& timer)
+{
+    const bool mk1 = timer.mcu->is_mk1;
+    const auto& FRT_STEP_TABLE = mk1 ? FRT_STEP_TABLE_MK1 : FRT_STEP_TABLE_GENERIC;
+    const auto& TIMER_STEP_TABLE = mk1 ? TIMER_STEP_TABLE_MK1 : TIMER_STEP_TABLE_GENERIC;
+
+    uint64_t next = TIMER_NO_EVENT;
+
+    for (int i = 0; i < 3; i++)
+    {
+        const frt_t *ftimer = &timer.frt[i];
+
+        if ((ftimer->tcr & 0x70) == 0)
+            continue;
+
+        const bool cclra = (ftimer->tcsr & 1) != 0;
+        const uint64_t ovf = TIMER_StepsToOverflow(ftimer->frc, 0xffff, cclra, ftimer->ocra);
+        const uint64_t ma = TIMER_StepsToMatch(ftimer->frc, ftimer->ocra, 0xffff, cclra, ftimer->ocra);
+        const uint64_t mb = TIMER_StepsToMatch(ftimer->frc, ftimer->ocrb, 0xffff, cclra, ftimer->ocra);
+
+        uint64_t steps = TIMER_SourceSteps(timer, INTERRUPT_SOURCE_FRT0_FOVI + i * 4,
+                                           ftimer->tcr & 0x10, ftimer->tcsr & 0x10, ovf);
+        steps = Min(steps, TIMER_SourceSteps(timer, INTERRUPT_SOURCE_FRT0_OCIA + i * 4,
+                                             ftimer->tcr & 0x20, ftimer->tcsr & 0x20, ma));
+        steps = Min(steps, TIMER_SourceSteps(timer, INTERRUPT_SOURCE_FRT0_OCIB + i * 4,
+                                             ftimer->tcr & 0x40, ftimer->tcsr & 0x40, mb));
+
+        next = Min(next, TIMER_StepsToCycle(timer.cycles, FRT_STEP_TABLE[ftimer->tcr & 3], steps));
+    }
+
+    if (timer.tcr & 0xe0)
+    {
+        const bool clra = (timer.tcr & 24) == 8;
+        const bool clrb = (timer.tcr & 24) == 16;
+        const uint32_t clear = clra ? timer.tcora : timer.tcorb;
+        const uint64_t ovf = TIMER_StepsToOverflow(timer.tcnt, 0xff, clra || clrb, clear);
+        const uint64_t ma = TIMER_StepsToMatch(timer.tcnt, timer.tcora, 0xff, clra || clrb, clear);
+        const uint64_t mb = TIMER_StepsToMatch(timer.tcnt, timer.tcorb, 0xff, clra || clrb, clear);
+
+        uint64_t steps = TIMER_SourceSteps(timer, INTERRUPT_SOURCE_TIMER_OVI,
+                                           timer.tcr & 0x20, timer.tcsr & 0x20, ovf);
+        steps = Min(steps, TIMER_SourceSteps(timer, INTERRUPT_SOURCE_TIMER_CMIA,
+                                             timer.tcr & 0x40, timer.tcsr & 0x40, ma));
+        steps = Min(steps, TIMER_SourceSteps(timer, INTERRUPT_SOURCE_TIMER_CMIB,
+                                             timer.tcr & 0x80, timer.tcsr & 0x80, mb));
+
+        next = Min(next, TIMER_StepsToCycle(timer.cycles, TIMER_STEP_TABLE[timer.tcr & 7], steps));
+    }
+
+    return next;
+}
+
+// Counter step at which a status flag not yet set in `tcsr` will be set
+static uint64_t TIMER_NextFlagSteps(uint32_t tcsr, const uint32_t flags[3], uint64_t ovf, uint64_t ma, uint64_t mb)
+{
+    uint64_t steps = TIMER_NO_EVENT;
+    if ((tcsr & flags[0]) == 0)
+        steps = Min(steps, ovf);
+    if ((tcsr & flags[1]) == 0)
+        steps = Min(steps, ma);
+    if ((tcsr & flags[2]) == 0)
+        steps = Min(steps, mb);
+    return steps;
+}
+
+uint64_t TIMER_ReadStableUntil(const mcu_timer_t& timer, uint32_t address)
+{
+    const bool mk1 = timer.mcu->is_mk1;
+    const auto& FRT_STEP_TABLE = mk1 ? FRT_STEP_TABLE_MK1 : FRT_STEP_TABLE_GENERIC;
+    const auto& TIMER_STEP_TABLE = mk1 ? TIMER_STEP_TABLE_MK1 : TIMER_STEP_TABLE_GENERIC;
+
+    if (address >= 0x50)
+    {
+        if (address == DEV_TMR_TCNT)
+            return 0;
+        if (address != DEV_TMR_TCSR)
+            return TIMER_NO_EVENT;
+
+        const bool clra = (timer.tcr & 24) == 8;
+        const bool clrb = (timer.tcr & 24) == 16;
+        const uint32_t clear = clra ? timer.tcora : timer.tcorb;
+        const uint32_t flags[3] = { 0x20, 0x40, 0x80 };
+        const uint64_t steps = TIMER_NextFlagSteps(timer.tcsr, flags,
+            TIMER_StepsToOverflow(timer.tcnt, 0xff, clra || clrb, clear),
+            TIMER_StepsToMatch(timer.tcnt, timer.tcora, 0xff, clra || clrb, clear),
+            TIMER_StepsToMatch(timer.tcnt, timer.tcorb, 0xff, clra || clrb, clear));
+        return TIMER_StepsToCycle(timer.cycles, TIMER_STEP_TABLE[timer.tcr & 7], steps);
+    }
+
+    const uint32_t t = (address >> 4) - 1;
+    if (t > 2)
+        return TIMER_NO_EVENT;
+    const frt_t *ftimer = &timer.frt[t];
+
+    switch (address & 0x0f)
+    {
+    case REG_FRCH:
+        return 0;
+    case REG_TCSR:
+    {
+        const bool cclra = (ftimer->tcsr & 1) != 0;
+        const uint32_t flags[3] = { 0x10, 0x20, 0x40 };
+        const uint64_t steps = TIMER_NextFlagSteps(ftimer->tcsr, flags,
+            TIMER_StepsToOverflow(ftimer->frc, 0xffff, cclra, ftimer->ocra),
+            TIMER_StepsToMatch(ftimer->frc, ftimer->ocra, 0xffff, cclra, ftimer->ocra),
+            TIMER_StepsToMatch(ftimer->frc, ftimer->ocrb, 0xffff, cclra, ftimer->ocra));
+        return TIMER_StepsToCycle(timer.cycles, FRT_STEP_TABLE[ftimer->tcr & 3], steps);
+    }
     }
+    return TIMER_NO_EVENT;
 }
@@ -66,6 +66,13 @@ void TIMER_Init(mcu_timer_t& timer, mcu_t& mcu);
 void TIMER_Write(mcu_timer_t& timer, uint32_t address, uint8_t data);
 uint8_t TIMER_Read(mcu_timer_t& timer, uint32_t address);
 void TIMER_Clock(mcu_timer_t& timer, uint64_t cycles);
+// Returns the earliest mcu cycle count for which TIMER_Clock raises a new
+// interrupt request, or UINT64_MAX if no request is coming.
+uint64_t TIMER_NextEventCycle(const mcu_timer_t& timer);
+// Returns the earliest mcu cycle count at which reading device register
+// `address` could return something else, 0 if that may be any time. Only
+// valid right after TIMER_Clock.
+uint64_t TIMER_ReadStableUntil(const mcu_timer_t& timer, uint32_t address);
 
 void TIMER2_Write(mcu_timer_t& timer, uint32_t address, uint8_t data);
 uint8_t TIMER_Read2(mcu_timer_t& timer, uint32_t address);
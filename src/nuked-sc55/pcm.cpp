@@ -31,47 +31,57 @@
  *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  *  POSSIBILITY OF SUCH DAMAGE.
  */
+#include <array>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(NUKED_SC55_SSE41)
+#include <immintrin.h>
+#endif
 #include "mcu.h"
 #include "mcu_interrupt.h"
 #include "pcm.h"
 
-uint8_t PCM_ReadROM(pcm_t& pcm, uint32_t address)
+// Backing store for the unmapped banks, read with a mask of 0
+static const uint8_t pcm_rom_unmapped[1] = {0};
+
+void PCM_UpdateROMBanks(pcm_t& pcm)
 {
-    int bank;
-    if (pcm.config_reg_3d & 0x20)
-        bank = (address >> 21) & 7;
-    else
-        bank = (address >> 19) & 7;
-    switch (bank)
-    {
-        case 0:
-            if (pcm.mcu->is_mk1)
-                return pcm.waverom1[address & 0xfffff];
-            else
-                return pcm.waverom1[address & 0x1fffff];
-        case 1:
-            if (!pcm.mcu->is_jv880)
-                return pcm.waverom2[address & 0xfffff];
-            else
-                return pcm.waverom2[address & 0x1fffff];
-        case 2:
-            if (pcm.mcu->is_jv880)
-                return pcm.waverom_card[address & 0x1fffff];
-            else
-                return pcm.waverom3[address & 0xfffff];
-        case 3:
-        case 4:
-        case 5:
-        case 6:
-            if (pcm.mcu->is_jv880)
-                return pcm.waverom_exp[(address & 0x1fffff) + (bank - 3) * 0x200000];
-        default:
-            break;
-    }
-    return 0;
+    MCU_WithModel(*pcm.mcu, [&](auto model) {
+        using Model = decltype(model);
+
+        for (auto& bank : pcm.rom_banks)
+            bank = {pcm_rom_unmapped, 0};
+
+        if constexpr (Model::is_mk1)
+            pcm.rom_banks[0] = {pcm.waverom1, 0xfffff};
+        else
+            pcm.rom_banks[0] = {pcm.waverom1, 0x1fffff};
+
+        if constexpr (!Model::is_jv880)
+            pcm.rom_banks[1] = {pcm.waverom2, 0xfffff};
+        else
+            pcm.rom_banks[1] = {pcm.waverom2, 0x1fffff};
+
+        if constexpr (Model::is_jv880)
+            pcm.rom_banks[2] = {pcm.waverom_card, 0x1fffff};
+        else
+            pcm.rom_banks[2] = {pcm.waverom3, 0xfffff};
+
+        if constexpr (Model::is_jv880)
+        {
+            for (int bank = 3; bank < 7; bank++)
+                pcm.rom_banks[bank] = {pcm.waverom_exp + (bank - 3) * 0x200000, 0x1fffff};
+        }
+    });
+
+    pcm.rom_bank_shift = (pcm.config_reg_3d & 0x20) ? 21 : 19;
+}
+
+static inline uint8_t PCM_ReadROM(const pcm_t& pcm, uint32_t address)
+{
+    const pcm_rom_bank_t& bank = pcm.rom_banks[(address >> pcm.rom_bank_shift) & 7];
+    return bank.base[address & bank.mask];
 }
 
 void PCM_Write(pcm_t& pcm, uint32_t address, uint8_t data)
@@ -128,6 +138,7 @@ void PCM_Write(pcm_t& pcm, uint32_t address, uint8_t data)
     {
         pcm.config_reg_3d = data;
         pcm.config.reg_slots = (data & 31) + 1;
+        PCM_UpdateROMBanks(pcm);
     }
     else if (address == 0x3e)
     {
@@ -268,6 +279,7 @@ uint8_t PCM_Read(pcm_t& pcm, uint32_t address)
 void PCM_Init(pcm_t& pcm, mcu_t& mcu)
 {
     pcm.mcu = &mcu;
+    PCM_UpdateROMBanks(pcm);
 }
 
 // Sign-extends a 20-bit signed integer to a 32-bit signed integer.
@@ -321,96 +333,85 @@ static const int interp_lut[3][128] = {
     },
 };
 
+// Everything calc_tv derives from the speed byte of an envelope parameter.
+// Bit 3 of the type is only set once the first sample has been produced.
+struct pcm_tv_decode_t {
+    uint8_t type; // bits 0-2 of the type
+    uint8_t type_nfs; // bit 3 of the type, if nfs is set
+    uint8_t shift; // exponential approach
+    uint8_t ramp_shift; // linear ramp
+    uint16_t ramp_preshift;
+};
+
+static constexpr auto pcm_tv_decode = [] {
+    std::array<pcm_tv_decode_t, 256> table{};
+    for (int speed = 0; speed < 256; speed++)
+    {
+        int w1 = (speed & 0xf0) == 0;
+        int w2 = w1 || (speed & 0x10) != 0;
+        int w3 = (speed & 0x80) == 0 || ((speed & 0x40) == 0 && (!w2 || (speed & 0x20) == 0));
+
+        int type = w2;
+        if (speed & 0x20)
+            type |= 2;
+        if ((speed & 0x80) == 0 || (speed & 0x40) == 0)
+            type |= 4;
+
+        int preshift = (speed & 15) << 9;
+        if (!w1)
+            preshift |= 0x2000;
+
+        table[speed].type = type;
+        table[speed].type_nfs = w3 << 3;
+        table[speed].shift = (10 - (speed & 15)) & 15;
+        table[speed].ramp_shift = (10 - (((speed >> 4) & 14) | w2)) & 15;
+        table[speed].ramp_preshift = preshift;
+    }
+    return table;
+}();
+
+// Refreshes pcm.tv_step for the current tv_counter. For each value of bits
+// 0-2 of the envelope type it holds the low bits added to the level (bits
+// 0-3, taken bit-reversed from tv_counter) and whether the level is written
+// back this sample (bit 4).
+static void PCM_UpdateTVStep(pcm_t& pcm)
+{
+    static constexpr uint8_t reverse4[16] = {
+        0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+        0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf,
+    };
+    static constexpr int addlow_shift[4] = {2, 4, 6, 8};
+    static constexpr uint32_t write_mask[4] = {3, 15, 63, 127};
+
+    for (int rate = 0; rate < 4; rate++)
+    {
+        int addlow = reverse4[(pcm.tv_counter >> addlow_shift[rate]) & 15];
+        int write = (pcm.tv_counter & write_mask[rate]) == 0;
+        pcm.tv_step[rate] = addlow | (write << 4);
+    }
+
+    // Types with bit 2 set step every sample
+    for (int rate = 4; rate < 8; rate++)
+        pcm.tv_step[rate] = reverse4[pcm.tv_counter & 15] | (1 << 4);
+}
+
 inline void calc_tv(pcm_t& pcm, int e, int adjust, uint16_t *levelcur, int active, int *volmul)
 {
     // int adjust = ram2[3+e];
     // int levelcur = ram2[9+e] & 0x7fff;
     *levelcur &= 0x7fff;
-    int speed = adjust & 0xff;
+    const pcm_tv_decode_t& decode = pcm_tv_decode[adjust & 0xff];
     int target = (adjust >> 8) & 0xff;
 
+    int type = decode.type | (pcm.nfs ? decode.type_nfs : 0);
 
-    int w1 = (speed & 0xf0) == 0;
-    int w2 = w1 || (speed & 0x10) != 0;
-    int w3 = pcm.nfs &&
-        ((speed & 0x80) == 0 || ((speed & 0x40) == 0 && (!w2 || (speed & 0x20) == 0)));
-
-    int type = w2 | (w3 << 3);
-    if (speed & 0x20)
-        type |= 2;
-    if ((speed & 0x80) == 0 || (speed & 0x40) == 0)
-        type |= 4;
-
-
-    int write = !active;
-    int addlow = 0;
-    if (type & 4)
-    {
-        if (pcm.tv_counter & 8)
-            addlow |= 1;
-        if (pcm.tv_counter & 4)
-            addlow |= 2;
-        if (pcm.tv_counter & 2)
-            addlow |= 4;
-        if (pcm.tv_counter & 1)
-            addlow |= 8;
-        write |= 1;
-    }
-    else
-    {
-        switch (type & 3)
-        {
-        case 0:
-            if (pcm.tv_counter & 0x20)
-                addlow |= 1;
-            if (pcm.tv_counter & 0x10)
-                addlow |= 2;
-            if (pcm.tv_counter & 8)
-                addlow |= 4;
-            if (pcm.tv_counter & 4)
-                addlow |= 8;
-            write |= (pcm.tv_counter & 3) == 0;
-            break;
-        case 1:
-            if (pcm.tv_counter & 0x80)
-                addlow |= 1;
-            if (pcm.tv_counter & 0x40)
-                addlow |= 2;
-            if (pcm.tv_counter & 0x20)
-                addlow |= 4;
-            if (pcm.tv_counter & 0x10)
-                addlow |= 8;
-            write |= (pcm.tv_counter & 15) == 0;
-            break;
-        case 2:
-            if (pcm.tv_counter & 0x200)
-                addlow |= 1;
-            if (pcm.tv_counter & 0x100)
-                addlow |= 2;
-            if (pcm.tv_counter & 0x80)
-                addlow |= 4;
-            if (pcm.tv_counter & 0x40)
-                addlow |= 8;
-            write |= (pcm.tv_counter & 63) == 0;
-            break;
-        case 3:
-            if (pcm.tv_counter & 0x800)
-                addlow |= 1;
-            if (pcm.tv_counter & 0x400)
-                addlow |= 2;
-            if (pcm.tv_counter & 0x200)
-                addlow |= 4;
-            if (pcm.tv_counter & 0x100)
-                addlow |= 8;
-            write |= (pcm.tv_counter & 127) == 0;
-            break;
-        }
-    }
+    int step = pcm.tv_step[type & 7];
+    int write = !active || (step >> 4) != 0;
+    int addlow = step & 15;
 
     if ((type & 8) == 0)
     {
-        int shift = speed & 15;
-        shift = (10 - shift) & 15;
+        int shift = decode.shift;
 
         int sum1 = (target << 11); // 5
         if (e != 2 || active)
@@ -438,17 +439,13 @@ inline void calc_tv(pcm_t& pcm, int e, int adjust, uint16_t *levelcur, int activ
     }
     else
     {
-        int shift = (speed >> 4) & 14;
-        shift |= w2;
-        shift = (10 - shift) & 15;
+        int shift = decode.ramp_shift;
 
         int sum1 = target << 11; // 5
         if (e != 2 || active)
             sum1 -= (*levelcur << 4); // 6
         int neg = (sum1 & 0x80000) != 0;
-        int preshift = (speed & 15) << 9;
-        if (!w1)
-            preshift |= 0x2000;
+        int preshift = decode.ramp_preshift;
         if (neg)
             preshift ^= ~0x3f;
 
@@ -497,21 +494,22 @@ inline int eram_unpack(pcm_t& pcm, int addr, int type = 0)
     return val >> (18 - sh * 2 + type);
 }
 
+// Exponent eram_pack picks for bits 13..19 of the value: the number of bit
+// pairs above the 14-bit mantissa that hold something other than sign
+static constexpr auto eram_pack_shift = [] {
+    std::array<uint8_t, 128> table{};
+    for (int top = 0; top < 128; top++)
+    {
+        int mag = (top & 0x40) ? top ^ 0x7f : top;
+        table[top] = (mag >= 16) + (mag >= 4) + (mag >= 1);
+    }
+    return table;
+}();
+
 inline void eram_pack(pcm_t& pcm, int addr, int val)
 {
     addr &= 0x3fff;
-    int sh = 0;
-    int top = (val >> 13) & 0x7f;
-    if (top & 0x40)
-        top ^= 0x7f;
-    if (top >= 16)
-        sh = 3;
-    else if (top >= 4)
-        sh = 2;
-    else if (top >= 1)
-        sh = 1;
-    else
-        sh = 0;
+    int sh = eram_pack_shift[(val >> 13) & 0x7f];
 
     int data = (val >> (sh * 2)) & 0x3fff;
     data |= sh << 14;
@@ -583,523 +581,823 @@ void PCM_GetConfig(PCM_Config& config, uint8_t config_byte)
     }
 }
 
-void PCM_Update(pcm_t& pcm, uint64_t cycles)
+// Inputs and outputs of the per-voice filter, envelope multiply and pan/send
+// stage, laid out one lane per slot. PCM_UpdateModel gathers the inputs while
+// it walks the slots, runs the stage across all of them and then mixes the
+// outputs in slot order.
+struct pcm_voice_lanes_t {
+    // inputs
+    alignas(32) int32_t test[32];
+    alignas(32) int32_t reg1[32];
+    alignas(32) int32_t reg3[32];
+    alignas(32) int32_t reg2_6[32];
+    alignas(32) int32_t filter[32];
+    alignas(32) int32_t sel[32];
+    alignas(32) int32_t volmul1[32];
+    alignas(32) int32_t volmul2[32];
+    alignas(32) int32_t pan[32];
+    alignas(32) int32_t rc[32];
+
+    // outputs
+    alignas(32) int32_t v1[32];
+    alignas(32) int32_t v5[32];
+    alignas(32) int32_t sampl[32];
+    alignas(32) int32_t sampr[32];
+    alignas(32) int32_t rc0[32];
+    alignas(32) int32_t rc1[32];
+};
+
+// Per-slot values carried from the address generator over to the mixing loop
+struct pcm_slot_t {
+    int key;
+    int kon;
+    int active;
+    int usenew;
+    int newnibble;
+    int old_nibble;
+    int lane; // index into pcm_voice_lanes_t, -1 if the slot was skipped
+};
+
+// Reference implementation of the stage, also used for the lanes that do not
+// fill a whole vector
+template <bool MK1>
+static void PCM_VoiceStageScalar(pcm_voice_lanes_t& lanes, int begin, int end)
 {
-    while (pcm.cycles < cycles)
+    for (int i = begin; i < end; i++)
     {
-        const int voice_active = pcm.voice_mask & pcm.voice_mask_pending;
-        { // final mixing
-            int shifter = pcm.ram2[30][10];
-            int xr = ((shifter >> 0) ^ (shifter >> 1) ^ (shifter >> 7) ^ (shifter >> 12)) & 1;
-            shifter = (shifter >> 1) | (xr << 15);
-            pcm.ram2[30][10] = shifter;
+        const int test = lanes.test[i];
+        const int reg1 = lanes.reg1[i];
+        const int reg3 = lanes.reg3[i];
+        const int reg2_6 = lanes.reg2_6[i];
+        const int filter = lanes.filter[i];
+        int v1, v3, v5;
+
+        if constexpr (MK1)
+        {
+            int mult1 = multi(reg1, filter >> 8); // 8
+            int mult2 = multi(reg1, (filter >> 1) & 127); // 9
+            int mult3 = multi(reg1, reg2_6); // 10
 
-            pcm.accum_l = addclip20(pcm.accum_l, pcm.ram1[30][0], 0);
-            pcm.accum_r = addclip20(pcm.accum_r, pcm.ram1[30][1], 0);
+            int v2 = addclip20(reg3, mult1 >> 6, (mult1 >> 5) & 1); // 9
+            v1 = addclip20(v2, mult2 >> 13, (mult2 >> 12) & 1); // 10
+            int subvar = addclip20(v1, (mult3 >> 6), (mult3 >> 5) & 1); // 11
 
-            pcm.ram1[30][2] = addclip20(pcm.accum_l,
-                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
+            v3 = addclip20(test, subvar ^ 0xfffff, 1); // 12
 
-            pcm.ram1[30][4] = addclip20(pcm.accum_r,
-                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
+            int mult4 = multi(v3, filter >> 8);
+            int mult5 = multi(v3, (filter >> 1) & 127);
+            int v4 = addclip20(reg1, mult4 >> 6, (mult4 >> 5) & 1); // 14
+            v5 = addclip20(v4, mult5 >> 13, (mult5 >> 12) & 1); // 15
+        }
+        else
+        {
+            // hack: use 32-bit math to avoid overflow
+            int mult1 = reg1 * (int8_t)(filter >> 8); // 8
+            int mult2 = reg1 * (int8_t)((filter >> 1) & 127); // 9
+            int mult3 = reg1 * (int8_t)reg2_6; // 10
 
-            pcm.ram1[30][0] = pcm.accum_l & pcm.config.write_mask;
-            pcm.ram1[30][1] = pcm.accum_r & pcm.config.write_mask;
+            int v2 = reg3 + (mult1 >> 6) + ((mult1 >> 5) & 1); // 9
+            v1 = v2 + (mult2 >> 13) + ((mult2 >> 12) & 1); // 10
+            int subvar = v1 + (mult3 >> 6) + ((mult3 >> 5) & 1); // 11
 
+            int tests = test;
+            tests <<= 12;
+            tests >>= 12;
 
-            int32_t samp_l = (int32_t)((pcm.ram1[30][2] & ~pcm.config.write_mask) << 12);
-            int32_t samp_r = (int32_t)((pcm.ram1[30][4] & ~pcm.config.write_mask) << 12);
+            v3 = tests - subvar; // 12
 
-            MCU_PostSample(*pcm.mcu, {samp_l, samp_r});
+            int mult4 = v3 * (int8_t)(filter >> 8);
+            int mult5 = v3 * (int8_t)((filter >> 1) & 127);
+            int v4 = reg1 + (mult4 >> 6) + ((mult4 >> 5) & 1); // 14
+            v5 = v4 + (mult5 >> 13) + ((mult5 >> 12) & 1); // 15
+        }
 
-            xr = ((shifter >> 0) ^ (shifter >> 1) ^ (shifter >> 7) ^ (shifter >> 12)) & 1;
-            shifter = (shifter >> 1) | (xr << 15);
+        const int volmul1 = lanes.volmul1[i];
+        const int volmul2 = lanes.volmul2[i];
 
-            pcm.accum_l = addclip20(pcm.accum_l, pcm.ram1[30][0], 0);
-            pcm.accum_r = addclip20(pcm.accum_r, pcm.ram1[30][1], 0);
+        int sample = lanes.sel[i] == 0 ? v1 : v3;
 
-            pcm.ram1[30][3] = addclip20(pcm.accum_l,
-                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
+        int multiv1 = multi(sample, volmul1 >> 8);
+        int multiv2 = multi(sample, (volmul1 >> 1) & 127);
 
-            pcm.ram1[30][5] = addclip20(pcm.accum_r,
-                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
+        int sample2 = addclip20(multiv1 >> 6, multiv2 >> 13, ((multiv2 >> 12) | (multiv1 >> 5)) & 1);
 
-            if (!pcm.disable_oversampling && pcm.config.oversampling) // oversampling
-            {
-                pcm.ram2[30][10] = shifter;
+        int multiv3 = multi(sample2, volmul2 >> 8);
+        int multiv4 = multi(sample2, (volmul2 >> 1) & 127);
 
-                pcm.ram1[30][0] = pcm.accum_l & pcm.config.write_mask;
-                pcm.ram1[30][1] = pcm.accum_r & pcm.config.write_mask;
+        int sample3 = addclip20(multiv3 >> 6, multiv4 >> 13, ((multiv4 >> 12) | (multiv3 >> 5)) & 1);
 
+        const int pan = lanes.pan[i];
+        const int rc = lanes.rc[i];
 
-                samp_l = (int32_t)((pcm.ram1[30][3] & ~pcm.config.write_mask) << 12);
-                samp_r = (int32_t)((pcm.ram1[30][5] & ~pcm.config.write_mask) << 12);
+        lanes.v1[i] = v1;
+        lanes.v5[i] = v5;
+        lanes.sampl[i] = multi(sample3, (pan >> 8) & 255);
+        lanes.sampr[i] = multi(sample3, (pan >> 0) & 255);
+        lanes.rc0[i] = multi(sample3, (rc >> 8) & 255) >> 5; // reverb
+        lanes.rc1[i] = multi(sample3, (rc >> 0) & 255) >> 5; // chorus
+    }
+}
 
-                MCU_PostSample(*pcm.mcu, {samp_l, samp_r});
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(NUKED_SC55_SSE41)
+#define PCM_VOICE_SIMD
+
+#if defined(__AVX2__)
+struct pcm_vec_t {
+    using v = __m256i;
+    static const int WIDTH = 8;
+
+    static v load(const int32_t* p) { return _mm256_load_si256((const __m256i*)p); }
+    static void store(int32_t* p, v a) { _mm256_store_si256((__m256i*)p, a); }
+    static v set1(int32_t a) { return _mm256_set1_epi32(a); }
+    static v add(v a, v b) { return _mm256_add_epi32(a, b); }
+    static v sub(v a, v b) { return _mm256_sub_epi32(a, b); }
+    static v mul(v a, v b) { return _mm256_mullo_epi32(a, b); }
+    static v and_(v a, v b) { return _mm256_and_si256(a, b); }
+    static v or_(v a, v b) { return _mm256_or_si256(a, b); }
+    static v xor_(v a, v b) { return _mm256_xor_si256(a, b); }
+    template <int N> static v sra(v a) { return _mm256_srai_epi32(a, N); }
+    template <int N> static v sll(v a) { return _mm256_slli_epi32(a, N); }
+    // a where `mask` is zero, b elsewhere
+    static v select_zero(v mask, v a, v b)
+    {
+        return _mm256_blendv_epi8(b, a, _mm256_cmpeq_epi32(mask, _mm256_setzero_si256()));
+    }
+};
+#else
+struct pcm_vec_t {
+    using v = __m128i;
+    static const int WIDTH = 4;
+
+    static v load(const int32_t* p) { return _mm_load_si128((const __m128i*)p); }
+    static void store(int32_t* p, v a) { _mm_store_si128((__m128i*)p, a); }
+    static v set1(int32_t a) { return _mm_set1_epi32(a); }
+    static v add(v a, v b) { return _mm_add_epi32(a, b); }
+    static v sub(v a, v b) { return _mm_sub_epi32(a, b); }
+    static v mul(v a, v b) { return _mm_mullo_epi32(a, b); }
+    static v and_(v a, v b) { return _mm_and_si128(a, b); }
+    static v or_(v a, v b) { return _mm_or_si128(a, b); }
+    static v xor_(v a, v b) { return _mm_xor_si128(a, b); }
+    template <int N> static v sra(v a) { return _mm_srai_epi32(a, N); }
+    template <int N> static v sll(v a) { return _mm_slli_epi32(a, N); }
+    // a where `mask` is zero, b elsewhere
+    static v select_zero(v mask, v a, v b)
+    {
+        return _mm_blendv_epi8(b, a, _mm_cmpeq_epi32(mask, _mm_setzero_si128()));
+    }
+};
+#endif
+
+// PCM_VoiceStageScalar for pcm_vec_t::WIDTH slots at a time. Every step is
+// the same 32-bit integer operation as in the scalar code, so the results are
+// bit-exact.
+template <bool MK1>
+static void PCM_VoiceStageSIMD(pcm_voice_lanes_t& lanes, int end)
+{
+    using V = pcm_vec_t;
+    using v = V::v;
+
+    const v one = V::set1(1);
+    const v low7 = V::set1(127);
+    const v mask20 = V::set1(0xfffff);
+
+    const auto sx20 = [](v a) { return V::sra<12>(V::sll<12>(a)); };
+    const auto sx8 = [](v a) { return V::sra<24>(V::sll<24>(a)); };
+
+    for (int i = 0; i < end; i += V::WIDTH)
+    {
+        const v test = V::load(&lanes.test[i]);
+        const v reg1 = V::load(&lanes.reg1[i]);
+        const v reg3 = V::load(&lanes.reg3[i]);
+        const v reg2_6 = V::load(&lanes.reg2_6[i]);
+        const v filter = V::load(&lanes.filter[i]);
+
+        const v filter_hi = sx8(V::sra<8>(filter));
+        const v filter_lo = V::and_(V::sra<1>(filter), low7);
+
+        v v1, v3, v5;
+
+        if constexpr (MK1)
+        {
+            const v reg1s = sx20(reg1);
+            const v mult1 = V::mul(reg1s, filter_hi);
+            const v mult2 = V::mul(reg1s, filter_lo);
+            const v mult3 = V::mul(reg1s, reg2_6);
+
+            const v v2 = V::add(V::add(sx20(reg3), sx20(V::sra<6>(mult1))),
+                V::and_(V::sra<5>(mult1), one));
+            v1 = V::add(V::add(sx20(v2), sx20(V::sra<13>(mult2))),
+                V::and_(V::sra<12>(mult2), one));
+            const v subvar = V::add(V::add(sx20(v1), sx20(V::sra<6>(mult3))),
+                V::and_(V::sra<5>(mult3), one));
+
+            v3 = V::add(V::add(sx20(test), sx20(V::xor_(subvar, mask20))), one);
+
+            const v v3s = sx20(v3);
+            const v mult4 = V::mul(v3s, filter_hi);
+            const v mult5 = V::mul(v3s, filter_lo);
+            const v v4 = V::add(V::add(reg1s, sx20(V::sra<6>(mult4))),
+                V::and_(V::sra<5>(mult4), one));
+            v5 = V::add(V::add(sx20(v4), sx20(V::sra<13>(mult5))),
+                V::and_(V::sra<12>(mult5), one));
+        }
+        else
+        {
+            const v mult1 = V::mul(reg1, filter_hi);
+            const v mult2 = V::mul(reg1, filter_lo);
+            const v mult3 = V::mul(reg1, sx8(reg2_6));
+
+            const v v2 = V::add(V::add(reg3, V::sra<6>(mult1)), V::and_(V::sra<5>(mult1), one));
+            v1 = V::add(V::add(v2, V::sra<13>(mult2)), V::and_(V::sra<12>(mult2), one));
+            const v subvar = V::add(V::add(v1, V::sra<6>(mult3)), V::and_(V::sra<5>(mult3), one));
+
+            v3 = V::sub(sx20(test), subvar);
+
+            const v mult4 = V::mul(v3, filter_hi);
+            const v mult5 = V::mul(v3, filter_lo);
+            const v v4 = V::add(V::add(reg1, V::sra<6>(mult4)), V::and_(V::sra<5>(mult4), one));
+            v5 = V::add(V::add(v4, V::sra<13>(mult5)), V::and_(V::sra<12>(mult5), one));
+        }
+
+        const v volmul1 = V::load(&lanes.volmul1[i]);
+        const v volmul2 = V::load(&lanes.volmul2[i]);
+
+        const v sample = sx20(V::select_zero(V::load(&lanes.sel[i]), v1, v3));
+
+        const v multiv1 = V::mul(sample, sx8(V::sra<8>(volmul1)));
+        const v multiv2 = V::mul(sample, V::and_(V::sra<1>(volmul1), low7));
+
+        const v sample2 = sx20(V::add(V::add(sx20(V::sra<6>(multiv1)), sx20(V::sra<13>(multiv2))),
+            V::and_(V::or_(V::sra<12>(multiv2), V::sra<5>(multiv1)), one)));
+
+        const v multiv3 = V::mul(sample2, sx8(V::sra<8>(volmul2)));
+        const v multiv4 = V::mul(sample2, V::and_(V::sra<1>(volmul2), low7));
+
+        const v sample3 = sx20(V::add(V::add(sx20(V::sra<6>(multiv3)), sx20(V::sra<13>(multiv4))),
+            V::and_(V::or_(V::sra<12>(multiv4), V::sra<5>(multiv3)), one)));
+
+        const v pan = V::load(&lanes.pan[i]);
+        const v rc = V::load(&lanes.rc[i]);
+
+        V::store(&lanes.v1[i], v1);
+        V::store(&lanes.v5[i], v5);
+        V::store(&lanes.sampl[i], V::mul(sample3, sx8(V::sra<8>(pan))));
+        V::store(&lanes.sampr[i], V::mul(sample3, sx8(pan)));
+        V::store(&lanes.rc0[i], V::sra<5>(V::mul(sample3, sx8(V::sra<8>(rc)))));
+        V::store(&lanes.rc1[i], V::sra<5>(V::mul(sample3, sx8(rc))));
+    }
+}
+#endif
+
+// Runs the stage for slots [0, end)
+template <bool MK1>
+static void PCM_VoiceStage(pcm_voice_lanes_t& lanes, int end)
+{
+#ifdef PCM_VOICE_SIMD
+    const int simd_end = end / pcm_vec_t::WIDTH * pcm_vec_t::WIDTH;
+    PCM_VoiceStageSIMD<MK1>(lanes, simd_end);
+    PCM_VoiceStageScalar<MK1>(lanes, simd_end, end);
+#else
+    PCM_VoiceStageScalar<MK1>(lanes, 0, end);
+#endif
+}
+
+// Reverb and chorus network, run once per sample between the final mix and
+// the voice loop. Returns the reverb/chorus outputs that the voice loop mixes
+// into the accumulators and sends.
+static void PCM_UpdateEffects(pcm_t& pcm, int (&rcadd)[6], int (&rcadd2)[6])
+{
+    // Delay line taps for this sample: ram2[28][0..11] and ram2[29][0..11] are
+    // offsets into eram relative to tv_counter
+    int tap[24];
+    for (int i = 0; i < 24; i++)
+        tap[i] = (pcm.ram2[28 + i / 12][i % 12] + pcm.tv_counter) & 0x3fff;
+
+    { // fixme
+        if (pcm.ram2[31][8] & 0x8000)
+            pcm.ram2[31][9] = pcm.ram2[31][8] & 0x7fff;
+        else
+            pcm.ram2[31][10] = pcm.ram2[31][8] & 0x7fff;
+
+        if ((0x4000 - pcm.ram2[31][8]) & 0x8000)
+            pcm.ram2[31][10] = (0x4000 - pcm.ram2[31][8]) & 0x7fff;
+        else
+            pcm.ram2[31][9] = (0x4000 - pcm.ram2[31][8]) & 0x7fff;
+    }
+
+    {
+        int v1 = pcm.ram2[31][1];
+
+        int m1 = multi(pcm.ram1[29][1], v1 >> 8) >> 5; // 14
+        int m2 = multi(pcm.rcsum[1], v1 & 255) >> 5; // 15
+
+        pcm.ram1[29][1] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1); // 16
+    }
+
+    {
+        int okey = (pcm.ram2[31][7] & 0x20) != 0;
+        int key = 1;
+        int active = okey && key;
+        int u = 0;
+        calc_tv(pcm, 1, pcm.ram2[30][0], &pcm.ram2[30][9], active, &u);
+    }
+
+    {
+        int v1 = pcm.ram2[30][1];
+        int m1 = multi(pcm.ram1[29][0], v1 >> 8) >> 5; // 17
+        int m2 = multi(pcm.rcsum[0], v1 & 255) >> 5; // 18
+
+        pcm.ram1[29][0] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1); // 19
+    }
+
+    {
+        {
+            // 1
+            int v1 = pcm.ram2[30][4];
+            int m1 = multi(pcm.ram1[29][0], (v1 >> 8)) >> 6;
+            int v2 = 0;
+            int s1 = eram_unpack(pcm, tap[1], 1);
+            int s2 = eram_unpack(pcm, tap[1]);
+            if ((v1 & 0x30) != 0)
+            {
+                v2 = s1;
             }
+            int v3 = addclip20(m1, v2 ^ 0xfffff, 1);
+            pcm.ram1[29][4] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[29][5] = addclip20(m2 >> 1, s2, m2 & 1);
         }
+        {
+            // 2
+            int v1 = pcm.ram2[30][4];
+            int v2 = 0;
+            int s1 = eram_unpack(pcm, tap[2], 1);
+            int s2 = eram_unpack(pcm, tap[2]);
+            if ((v1 & 0x30) != 0)
+            {
+                v2 = s1;
+            }
+            int v3 = addclip20(pcm.ram1[29][5], v2 ^ 0xfffff, 1);
+            pcm.ram1[29][5] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[28][0] = addclip20(m2 >> 1, s2, m2 & 1);
+        }
+        {
+            // 3
+            int v1 = pcm.ram2[30][4];
+            int v2 = 0;
+            int s1 = eram_unpack(pcm, tap[3], 1);
+            int s2 = eram_unpack(pcm, tap[3]);
+            if ((v1 & 0x30) != 0)
+            {
+                v2 = s1;
+            }
+            int v3 = addclip20(pcm.ram1[28][0], v2 ^ 0xfffff, 1);
+            pcm.ram1[28][0] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[28][1] = addclip20(m2 >> 1, s2, m2 & 1);
 
-        { // global counter for envelopes
-            if (!pcm.nfs)
-                pcm.tv_counter = pcm.ram2[31][8]; // fixme
 
-            pcm.tv_counter -= 1;
+            pcm.ram1[28][2] = eram_unpack(pcm, tap[5]);
+        }
+        {
+            // 4
+            int v1 = pcm.ram2[30][5];
+            int v2 = 0;
+            int s1 = eram_unpack(pcm, tap[4], 1);
+            int s2 = eram_unpack(pcm, tap[4]);
+            if ((v1 & 0x30) != 0)
+            {
+                v2 = s1;
+            }
+            int v3 = addclip20(pcm.ram1[28][1], v2 ^ 0xfffff, 1);
+            pcm.ram1[28][1] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[28][3] = addclip20(m2 >> 1, s2, m2 & 1);
 
-            pcm.tv_counter &= 0x3fff;
+
+            pcm.ram1[28][4] = eram_unpack(pcm, tap[13]);
+        }
+        {
+            // 5
+
+            int v1 = pcm.ram2[30][7];
+            int m1 = multi(pcm.ram1[29][2], (v1 >> 8)) >> 5;
+            int s1 = eram_unpack(pcm, tap[12]);
+            int m2 = multi(s1, v1 & 255) >> 5;
+            pcm.ram1[29][2] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1);
+
+            eram_pack(pcm, tap[0], pcm.ram1[29][4]);
         }
+        {
+            // 6
 
-        // chorus/reverb
+            int v1 = pcm.ram2[30][8];
+            int m1 = multi(pcm.ram1[29][3], (v1 >> 8)) >> 5;
+            int s1 = eram_unpack(pcm, tap[20]);
+            int m2 = multi(s1, v1 & 255) >> 5;
+            pcm.ram1[29][3] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1);
 
-        { // fixme
-            if (pcm.ram2[31][8] & 0x8000)
-                pcm.ram2[31][9] = pcm.ram2[31][8] & 0x7fff;
-            else
-                pcm.ram2[31][10] = pcm.ram2[31][8] & 0x7fff;
+            eram_pack(pcm, tap[1], pcm.ram1[29][5]);
 
-            if ((0x4000 - pcm.ram2[31][8]) & 0x8000)
-                pcm.ram2[31][10] = (0x4000 - pcm.ram2[31][8]) & 0x7fff;
-            else
-                pcm.ram2[31][9] = (0x4000 - pcm.ram2[31][8]) & 0x7fff;
+            eram_pack(pcm, tap[2], pcm.ram1[28][0]);
         }
+        {
+            // 7
+
+            int v1 = pcm.ram2[30][9];
+            int v2 = pcm.ram1[28][3];
+            int m1 = multi(pcm.ram1[29][2], (v1 >> 8)) >> 5;
+            int m2 = multi(pcm.ram1[29][3], (v1 >> 8)) >> 5;
+            pcm.ram1[28][3] = addclip20(v2, m1 >> 1, m1 & 1);
+            pcm.ram1[28][5] = addclip20(v2, m2 >> 1, m2 & 1);
 
+            eram_pack(pcm, tap[3], pcm.ram1[28][1]);
+        }
         {
-            int v1 = pcm.ram2[31][1];
+            // 8
 
-            int m1 = multi(pcm.ram1[29][1], v1 >> 8) >> 5; // 14
-            int m2 = multi(pcm.rcsum[1], v1 & 255) >> 5; // 15
+            int v1 = pcm.ram2[30][6];
+            int m1 = multi(pcm.ram1[28][2], v1 >> 8) >> 5;
 
-            pcm.ram1[29][1] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1); // 16
+            int v2 = addclip20(pcm.ram1[28][3], m1 >> 1, m1 & 1);
+            pcm.ram1[28][3] = v2;
+            int m2 = multi(v2, v1 & 255) >> 5;
+            pcm.ram1[28][2] = addclip20(pcm.ram1[28][2], m2 >> 1, m2 & 1);
+
+
+            pcm.ram1[28][1] = eram_unpack(pcm, tap[9]);
         }
+        {
+            // 9
 
+            int v1 = pcm.ram2[30][6];
+            int m1 = multi(pcm.ram1[28][4], v1 >> 8) >> 5;
+
+            int v2 = addclip20(pcm.ram1[28][5], m1 >> 1, m1 & 1);
+            pcm.ram1[28][5] = v2;
+            int m2 = multi(v2, v1 & 255) >> 5;
+            pcm.ram1[28][4] = addclip20(pcm.ram1[28][4], m2 >> 1, m2 & 1);
+
+
+            pcm.ram1[29][4] = eram_unpack(pcm, tap[17]);
+        }
         {
-            int okey = (pcm.ram2[31][7] & 0x20) != 0;
-            int key = 1;
-            int active = okey && key;
-            int u = 0;
-            calc_tv(pcm, 1, pcm.ram2[30][0], &pcm.ram2[30][9], active, &u);
+            // 10
+
+            int v1 = pcm.ram2[30][6];
+            int v2 = pcm.ram1[28][1];
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int s1 = eram_unpack(pcm, tap[8]);
+            int v3 = addclip20(m1 >> 1, s1, m1 & 1);
+            pcm.ram1[28][1] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[29][5] = addclip20(m2 >> 1, v2, m2 & 1);
+
+            eram_pack(pcm, tap[4], pcm.ram1[28][3]);
         }
+        {
+            // 11
+
+            int v1 = pcm.ram2[30][6];
+            int v2 = pcm.ram1[29][4];
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int s1 = eram_unpack(pcm, tap[16]);
+            int v3 = addclip20(m1 >> 1, s1, m1 & 1);
+            pcm.ram1[29][4] = v3;
+            int m2 = multi(v3, v1 & 255) >> 5;
+            pcm.ram1[28][0] = addclip20(m2 >> 1, v2, m2 & 1);
 
+
+            eram_pack(pcm, tap[5], pcm.ram1[28][2]);
+
+            eram_pack(pcm, tap[12], pcm.ram1[28][5]);
+        }
         {
-            int v1 = pcm.ram2[30][1];
-            int m1 = multi(pcm.ram1[29][0], v1 >> 8) >> 5; // 17
-            int m2 = multi(pcm.rcsum[0], v1 & 255) >> 5; // 18
+            // 12
 
-            pcm.ram1[29][0] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1); // 19
+            pcm.ram1[28][5] = eram_unpack(pcm, tap[6]);
         }
 
-        int rcadd[6] = {};
-        int rcadd2[6] = {};
+        {
+            // 13
+
+            int s1 = eram_unpack(pcm, tap[10]);
+            pcm.ram1[28][5] = addclip20(pcm.ram1[28][5], s1, 0);
+
+            pcm.ram1[28][2] = eram_unpack(pcm, tap[14]);
+        }
 
         {
-            {
-                // 1
-                int v1 = pcm.ram2[30][4];
-                int m1 = multi(pcm.ram1[29][0], (v1 >> 8)) >> 6;
-                int v2 = 0;
-                int s1 = eram_unpack(pcm, pcm.ram2[28][1] + pcm.tv_counter, 1);
-                int s2 = eram_unpack(pcm, pcm.ram2[28][1] + pcm.tv_counter);
-                if ((v1 & 0x30) != 0)
-                {
-                    v2 = s1;
-                }
-                int v3 = addclip20(m1, v2 ^ 0xfffff, 1);
-                pcm.ram1[29][4] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[29][5] = addclip20(m2 >> 1, s2, m2 & 1);
-            }
-            {
-                // 2
-                int v1 = pcm.ram2[30][4];
-                int v2 = 0;
-                int s1 = eram_unpack(pcm, pcm.ram2[28][2] + pcm.tv_counter, 1);
-                int s2 = eram_unpack(pcm, pcm.ram2[28][2] + pcm.tv_counter);
-                if ((v1 & 0x30) != 0)
-                {
-                    v2 = s1;
-                }
-                int v3 = addclip20(pcm.ram1[29][5], v2 ^ 0xfffff, 1);
-                pcm.ram1[29][5] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[28][0] = addclip20(m2 >> 1, s2, m2 & 1);
-            }
-            {
-                // 3
-                int v1 = pcm.ram2[30][4];
-                int v2 = 0;
-                int s1 = eram_unpack(pcm, pcm.ram2[28][3] + pcm.tv_counter, 1);
-                int s2 = eram_unpack(pcm, pcm.ram2[28][3] + pcm.tv_counter);
-                if ((v1 & 0x30) != 0)
-                {
-                    v2 = s1;
-                }
-                int v3 = addclip20(pcm.ram1[28][0], v2 ^ 0xfffff, 1);
-                pcm.ram1[28][0] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[28][1] = addclip20(m2 >> 1, s2, m2 & 1);
+            // 14
 
+            int s1 = eram_unpack(pcm, tap[18]);
+            int t1 = addclip20(s1, pcm.ram1[28][2], 0); // 6
 
-                pcm.ram1[28][2] = eram_unpack(pcm, pcm.ram2[28][5] + pcm.tv_counter);
-            }
-            {
-                // 4
-                int v1 = pcm.ram2[30][5];
-                int v2 = 0;
-                int s1 = eram_unpack(pcm, pcm.ram2[28][4] + pcm.tv_counter, 1);
-                int s2 = eram_unpack(pcm, pcm.ram2[28][4] + pcm.tv_counter);
-                if ((v1 & 0x30) != 0)
-                {
-                    v2 = s1;
-                }
-                int v3 = addclip20(pcm.ram1[28][1], v2 ^ 0xfffff, 1);
-                pcm.ram1[28][1] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[28][3] = addclip20(m2 >> 1, s2, m2 & 1);
+            pcm.ram1[28][5] = addclip20(t1, pcm.ram1[28][5], 0);
 
+            pcm.ram1[28][2] = eram_unpack(pcm, tap[7]);
+        }
 
-                pcm.ram1[28][4] = eram_unpack(pcm, pcm.ram2[29][1] + pcm.tv_counter);
-            }
-            {
-                // 5
+        {
+            // 15
 
-                int v1 = pcm.ram2[30][7];
-                int m1 = multi(pcm.ram1[29][2], (v1 >> 8)) >> 5;
-                int s1 = eram_unpack(pcm, pcm.ram2[29][0] + pcm.tv_counter);
-                int m2 = multi(s1, v1 & 255) >> 5;
-                pcm.ram1[29][2] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1);
+            int s1 = eram_unpack(pcm, tap[11]);
+            pcm.ram1[28][2] = addclip20(pcm.ram1[28][2], s1, 0);
 
-                eram_pack(pcm, pcm.ram2[28][0] + pcm.tv_counter, pcm.ram1[29][4]);
-            }
-            {
-                // 6
+            pcm.ram1[28][3] = eram_unpack(pcm, tap[15]);
+        }
 
-                int v1 = pcm.ram2[30][8];
-                int m1 = multi(pcm.ram1[29][3], (v1 >> 8)) >> 5;
-                int s1 = eram_unpack(pcm, pcm.ram2[29][8] + pcm.tv_counter);
-                int m2 = multi(s1, v1 & 255) >> 5;
-                pcm.ram1[29][3] = addclip20(m1 >> 1, m2 >> 1, (m1 | m2) & 1);
+        {
+            // 16
 
-                eram_pack(pcm, pcm.ram2[28][1] + pcm.tv_counter, pcm.ram1[29][5]);
+            int s1 = eram_unpack(pcm, tap[19]);
+            int t1 = addclip20(s1, pcm.ram1[28][2], 0);
+            pcm.ram1[28][2] = addclip20(t1, pcm.ram1[28][3], 0);
 
-                eram_pack(pcm, pcm.ram2[28][2] + pcm.tv_counter, pcm.ram1[28][0]);
-            }
-            {
-                // 7
 
-                int v1 = pcm.ram2[30][9];
-                int v2 = pcm.ram1[28][3];
-                int m1 = multi(pcm.ram1[29][2], (v1 >> 8)) >> 5;
-                int m2 = multi(pcm.ram1[29][3], (v1 >> 8)) >> 5;
-                pcm.ram1[28][3] = addclip20(v2, m1 >> 1, m1 & 1);
-                pcm.ram1[28][5] = addclip20(v2, m2 >> 1, m2 & 1);
+            eram_pack(pcm, tap[13], pcm.ram1[28][4]);
 
-                eram_pack(pcm, pcm.ram2[28][3] + pcm.tv_counter, pcm.ram1[28][1]);
-            }
-            {
-                // 8
+            eram_pack(pcm, tap[8], pcm.ram1[28][1]);
+        }
 
-                int v1 = pcm.ram2[30][6];
-                int m1 = multi(pcm.ram1[28][2], v1 >> 8) >> 5;
+        {
+            // 17
+            int v1 = pcm.ram2[30][2];
+            int v2 = pcm.ram1[28][5];
 
-                int v2 = addclip20(pcm.ram1[28][3], m1 >> 1, m1 & 1);
-                pcm.ram1[28][3] = v2;
-                int m2 = multi(v2, v1 & 255) >> 5;
-                pcm.ram1[28][2] = addclip20(pcm.ram1[28][2], m2 >> 1, m2 & 1);
+            int m1 = multi(v2, v1 >> 8) >> 5;
 
+            rcadd[0] = m1;
 
-                pcm.ram1[28][1] = eram_unpack(pcm, pcm.ram2[28][9] + pcm.tv_counter);
-            }
-            {
-                // 9
+            rcadd2[0] = multi(v2, v1 & 255) >> 5;
+
+            int t1 = eram_unpack(pcm, tap[22] + 1); //? 3a6e
+            eram_pack(pcm, tap[9], pcm.ram1[29][5]);
+            pcm.ram1[29][5] = t1;
+        }
 
-                int v1 = pcm.ram2[30][6];
-                int m1 = multi(pcm.ram1[28][4], v1 >> 8) >> 5;
+        {
+            // 18
+            int v1 = pcm.ram2[30][3];
+            int v2 = pcm.ram1[28][2];
 
-                int v2 = addclip20(pcm.ram1[28][5], m1 >> 1, m1 & 1);
-                pcm.ram1[28][5] = v2;
-                int m2 = multi(v2, v1 & 255) >> 5;
-                pcm.ram1[28][4] = addclip20(pcm.ram1[28][4], m2 >> 1, m2 & 1);
+            int m1 = multi(v2, v1 >> 8) >> 5;
 
+            rcadd[1] = m1;
 
-                pcm.ram1[29][4] = eram_unpack(pcm, pcm.ram2[29][5] + pcm.tv_counter);
-            }
-            {
-                // 10
-
-                int v1 = pcm.ram2[30][6];
-                int v2 = pcm.ram1[28][1];
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int s1 = eram_unpack(pcm, pcm.ram2[28][8] + pcm.tv_counter);
-                int v3 = addclip20(m1 >> 1, s1, m1 & 1);
-                pcm.ram1[28][1] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[29][5] = addclip20(m2 >> 1, v2, m2 & 1);
-
-                eram_pack(pcm, pcm.ram2[28][4] + pcm.tv_counter, pcm.ram1[28][3]);
-            }
-            {
-                // 11
+            rcadd2[1] = multi(v2, v1 & 255) >> 5;
 
-                int v1 = pcm.ram2[30][6];
-                int v2 = pcm.ram1[29][4];
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int s1 = eram_unpack(pcm, pcm.ram2[29][4] + pcm.tv_counter);
-                int v3 = addclip20(m1 >> 1, s1, m1 & 1);
-                pcm.ram1[29][4] = v3;
-                int m2 = multi(v3, v1 & 255) >> 5;
-                pcm.ram1[28][0] = addclip20(m2 >> 1, v2, m2 & 1);
+            pcm.ram1[28][1] = eram_unpack(pcm, tap[23] + 1); //? 3a1e
+        }
+        {
+            // 19
 
+            int v1 = pcm.ram2[31][9];
 
-                eram_pack(pcm, pcm.ram2[28][5] + pcm.tv_counter, pcm.ram1[28][2]);
+            int s1 = eram_unpack(pcm, tap[22]); //? 3a6d
 
-                eram_pack(pcm, pcm.ram2[29][0] + pcm.tv_counter, pcm.ram1[28][5]);
-            }
-            {
-                // 12
+            eram_pack(pcm, tap[16], pcm.ram1[29][4]);
 
-                pcm.ram1[28][5] = eram_unpack(pcm, pcm.ram2[28][6] + pcm.tv_counter);
-            }
+            int m1 = multi(s1, v1 >> 8) >> 5;
+            int m2 = multi(pcm.ram1[29][5], v1 >> 8) >> 5;
 
-            {
-                // 13
+            int t2 = addclip20(s1, (m1 >> 1) ^ 0xfffff, 1);
 
-                int s1 = eram_unpack(pcm, pcm.ram2[28][10] + pcm.tv_counter);
-                pcm.ram1[28][5] = addclip20(pcm.ram1[28][5], s1, 0);
+            pcm.ram1[29][5] = addclip20(t2, m2 >> 1, m2 & 1);
+        }
+        {
+            // 20
 
-                pcm.ram1[28][2] = eram_unpack(pcm, pcm.ram2[29][2] + pcm.tv_counter);
-            }
+            int v1 = pcm.ram2[31][10];
 
-            {
-                // 14
+            int s1 = eram_unpack(pcm, tap[23]); //? 3a1d
 
-                int s1 = eram_unpack(pcm, pcm.ram2[29][6] + pcm.tv_counter);
-                int t1 = addclip20(s1, pcm.ram1[28][2], 0); // 6
+            eram_pack(pcm, tap[17], pcm.ram1[28][0]);
 
-                pcm.ram1[28][5] = addclip20(t1, pcm.ram1[28][5], 0);
+            int m1 = multi(s1, v1 >> 8) >> 5;
+            int m2 = multi(pcm.ram1[28][1], v1 >> 8) >> 5;
 
-                pcm.ram1[28][2] = eram_unpack(pcm, pcm.ram2[28][7] + pcm.tv_counter);
-            }
+            int t2 = addclip20(s1, (m1 >> 1) ^ 0xfffff, 1);
 
-            {
-                // 15
+            pcm.ram1[28][1] = addclip20(t2, m2 >> 1, m2 & 1);
 
-                int s1 = eram_unpack(pcm, pcm.ram2[28][11] + pcm.tv_counter);
-                pcm.ram1[28][2] = addclip20(pcm.ram1[28][2], s1, 0);
+            eram_pack(pcm, tap[21], pcm.ram1[29][1]);
+        }
+        {
+            // 21
 
-                pcm.ram1[28][3] = eram_unpack(pcm, pcm.ram2[29][3] + pcm.tv_counter);
-            }
+            int v1 = pcm.ram2[31][2];
+            int v2 = pcm.ram1[29][5];
 
-            {
-                // 16
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int m2 = multi(v2, v1 & 255) >> 5;
 
-                int s1 = eram_unpack(pcm, pcm.ram2[29][7] + pcm.tv_counter);
-                int t1 = addclip20(s1, pcm.ram1[28][2], 0);
-                pcm.ram1[28][2] = addclip20(t1, pcm.ram1[28][3], 0);
+            rcadd[2] = m1;
+            rcadd2[2] = m2;
+        }
+        {
+            // 22
 
+            int v1 = pcm.ram2[31][3];
+            int v2 = pcm.ram1[29][5];
 
-                eram_pack(pcm, pcm.ram2[29][1] + pcm.tv_counter, pcm.ram1[28][4]);
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int m2 = multi(v2, v1 & 255) >> 5;
 
-                eram_pack(pcm, pcm.ram2[28][8] + pcm.tv_counter, pcm.ram1[28][1]);
-            }
+            rcadd[3] = m1;
+            rcadd2[3] = m2;
+        }
+        {
+            // 23
 
-            {
-                // 17
-                int v1 = pcm.ram2[30][2];
-                int v2 = pcm.ram1[28][5];
+            int v1 = pcm.ram2[31][4];
+            int v2 = pcm.ram1[28][1];
+
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int m2 = multi(v2, v1 & 255) >> 5;
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
+            rcadd[4] = m1;
+            rcadd2[4] = m2;
+        }
+        {
+            // 31
 
-                rcadd[0] = m1;
+            int v1 = pcm.ram2[31][5];
+            int v2 = pcm.ram1[28][1];
 
-                rcadd2[0] = multi(v2, v1 & 255) >> 5;
+            int m1 = multi(v2, v1 >> 8) >> 5;
+            int m2 = multi(v2, v1 & 255) >> 5;
 
-                int t1 = eram_unpack(pcm, pcm.ram2[29][10] + pcm.tv_counter + 1); //? 3a6e
-                eram_pack(pcm, pcm.ram2[28][9] + pcm.tv_counter, pcm.ram1[29][5]);
-                pcm.ram1[29][5] = t1;
-            }
+            rcadd[5] = m1;
+            rcadd2[5] = m2;
 
             {
-                // 18
-                int v1 = pcm.ram2[30][3];
-                int v2 = pcm.ram1[28][2];
+                // address generator
+
+                int key = 1;
+                int okey = (pcm.ram2[31][7] & 0x20) != 0;
+                int active = key && okey;
+                int kon = key && !okey;
+
+                int b15 = (pcm.ram2[31][8] & 0x8000) != 0; // 0
+                int b6 = (pcm.ram2[31][7] & 0x40) != 0; // 1
+                int b7 = (pcm.ram2[31][7] & 0x80) != 0; // 1
+                int old_nibble = (pcm.ram2[31][7] >> 12) & 15; // 1
+                (void)old_nibble; // unused
+
+                int address = pcm.ram1[31][4]; // 0
+                int address_end = pcm.ram1[31][0]; // 1 or 2
+                int address_loop = pcm.ram1[31][2]; // 2 or 1
+
+                int sub_phase = (pcm.ram2[31][8] & 0x3fff); // 1
+                int interp_ratio = (sub_phase >> 7) & 127;
+                (void)interp_ratio; // unused
+                sub_phase += pcm.ram2[pcm.ram2[31][7] & 31][0]; // 5
+                int sub_phase_of = (sub_phase >> 14) & 7;
+                if (pcm.nfs)
+                {
+                    pcm.ram2[31][8] &= ~0x3fff;
+                    pcm.ram2[31][8] |= sub_phase & 0x3fff;
+                }
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
 
-                rcadd[1] = m1;
+                // address 0
+                int address_cnt = address;
 
-                rcadd2[1] = multi(v2, v1 & 255) >> 5;
+                int cmp1 = b15 ? address_loop : address_end;
+                int cmp2 = address_cnt;
+                int address_cmp = (cmp1 & 0xfffff) == (cmp2 & 0xfffff); // 9
+                int next_b15 = b15;
 
-                pcm.ram1[28][1] = eram_unpack(pcm, pcm.ram2[29][11] + pcm.tv_counter + 1); //? 3a1e
-            }
-            {
-                // 19
+                int next_address = address_cnt; // 11
+
+                cmp1 = (!b6 && address_cmp) ? address_loop : address_cnt;
+                cmp2 = address_cnt;
+                int address_cnt2 = (kon || (!b6 && address_cmp)) ? cmp1 : cmp2;
+
+                int address_add = (!address_cmp && b6 && !b15) || (!address_cmp && !b6);
+                int address_sub = !address_cmp && b6 && b15;
+                if (b7)
+                    address_cnt2 -= address_add - address_sub;
+                else
+                    address_cnt2 += address_add - address_sub;
+                address_cnt = address_cnt2 & 0xfffff; // 11
+                b15 = b6 && (b15 ^ address_cmp); // 11
 
-                int v1 = pcm.ram2[31][9];
+                cmp1 = b15 ? address_loop : address_end;
+                cmp2 = address_cnt;
+                address_cmp = (cmp1 & 0xfffff) == (cmp2 & 0xfffff); // 13
 
-                int s1 = eram_unpack(pcm, pcm.ram2[29][10] + pcm.tv_counter); //? 3a6d
+                if (sub_phase_of >= 1)
+                {
+                    next_address = address_cnt; // 13
+                    next_b15 = b15;
+                }
 
-                eram_pack(pcm, pcm.ram2[29][4] + pcm.tv_counter, pcm.ram1[29][4]);
+                if (active && pcm.nfs)
+                    pcm.ram1[31][4] = next_address;
 
-                int m1 = multi(s1, v1 >> 8) >> 5;
-                int m2 = multi(pcm.ram1[29][5], v1 >> 8) >> 5;
+                if (pcm.nfs)
+                {
+                    pcm.ram2[31][8] &= ~0x8000;
+                    pcm.ram2[31][8] |= next_b15 << 15;
+                }
 
-                int t2 = addclip20(s1, (m1 >> 1) ^ 0xfffff, 1);
+                int t1 = address_loop; // 18
+                int t2 = pcm.ram1[31][4] - t1; // 19
+                int t3 = address_end - t2; // 20
+                int t4 = pcm.ram1[31][4]; // 23
 
-                pcm.ram1[29][5] = addclip20(t2, m2 >> 1, m2 & 1);
+                pcm.ram2[29][10] = t3;
+                pcm.ram2[29][11] = t4;
             }
-            {
-                // 20
+        }
+    }
+}
 
-                int v1 = pcm.ram2[31][10];
+template <typename Model>
+void PCM_UpdateModel(pcm_t& pcm, uint64_t cycles)
+{
+    while (pcm.cycles < cycles)
+    {
+        const int voice_active = pcm.voice_mask & pcm.voice_mask_pending;
+        { // final mixing
+            int shifter = pcm.ram2[30][10];
+            int xr = ((shifter >> 0) ^ (shifter >> 1) ^ (shifter >> 7) ^ (shifter >> 12)) & 1;
+            shifter = (shifter >> 1) | (xr << 15);
+            pcm.ram2[30][10] = shifter;
 
-                int s1 = eram_unpack(pcm, pcm.ram2[29][11] + pcm.tv_counter); //? 3a1d
+            pcm.accum_l = addclip20(pcm.accum_l, pcm.ram1[30][0], 0);
+            pcm.accum_r = addclip20(pcm.accum_r, pcm.ram1[30][1], 0);
 
-                eram_pack(pcm, pcm.ram2[29][5] + pcm.tv_counter, pcm.ram1[28][0]);
+            pcm.ram1[30][2] = addclip20(pcm.accum_l,
+                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
 
-                int m1 = multi(s1, v1 >> 8) >> 5;
-                int m2 = multi(pcm.ram1[28][1], v1 >> 8) >> 5;
+            pcm.ram1[30][4] = addclip20(pcm.accum_r,
+                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
 
-                int t2 = addclip20(s1, (m1 >> 1) ^ 0xfffff, 1);
+            pcm.ram1[30][0] = pcm.accum_l & pcm.config.write_mask;
+            pcm.ram1[30][1] = pcm.accum_r & pcm.config.write_mask;
 
-                pcm.ram1[28][1] = addclip20(t2, m2 >> 1, m2 & 1);
 
-                eram_pack(pcm, pcm.ram2[29][9] + pcm.tv_counter, pcm.ram1[29][1]);
-            }
-            {
-                // 21
+            int32_t samp_l = (int32_t)((pcm.ram1[30][2] & ~pcm.config.write_mask) << 12);
+            int32_t samp_r = (int32_t)((pcm.ram1[30][4] & ~pcm.config.write_mask) << 12);
 
-                int v1 = pcm.ram2[31][2];
-                int v2 = pcm.ram1[29][5];
+            MCU_PostSample(*pcm.mcu, {samp_l, samp_r});
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int m2 = multi(v2, v1 & 255) >> 5;
+            xr = ((shifter >> 0) ^ (shifter >> 1) ^ (shifter >> 7) ^ (shifter >> 12)) & 1;
+            shifter = (shifter >> 1) | (xr << 15);
 
-                rcadd[2] = m1;
-                rcadd2[2] = m2;
-            }
-            {
-                // 22
+            pcm.accum_l = addclip20(pcm.accum_l, pcm.ram1[30][0], 0);
+            pcm.accum_r = addclip20(pcm.accum_r, pcm.ram1[30][1], 0);
 
-                int v1 = pcm.ram2[31][3];
-                int v2 = pcm.ram1[29][5];
+            pcm.ram1[30][3] = addclip20(pcm.accum_l,
+                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int m2 = multi(v2, v1 & 255) >> 5;
+            pcm.ram1[30][5] = addclip20(pcm.accum_r,
+                pcm.config.orval | (shifter & pcm.config.noise_mask), 0);
 
-                rcadd[3] = m1;
-                rcadd2[3] = m2;
-            }
+            if (!pcm.disable_oversampling && pcm.config.oversampling) // oversampling
             {
-                // 23
+                pcm.ram2[30][10] = shifter;
+
+                pcm.ram1[30][0] = pcm.accum_l & pcm.config.write_mask;
+                pcm.ram1[30][1] = pcm.accum_r & pcm.config.write_mask;
 
-                int v1 = pcm.ram2[31][4];
-                int v2 = pcm.ram1[28][1];
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int m2 = multi(v2, v1 & 255) >> 5;
+                samp_l = (int32_t)((pcm.ram1[30][3] & ~pcm.config.write_mask) << 12);
+                samp_r = (int32_t)((pcm.ram1[30][5] & ~pcm.config.write_mask) << 12);
 
-                rcadd[4] = m1;
-                rcadd2[4] = m2;
+                MCU_PostSample(*pcm.mcu, {samp_l, samp_r});
             }
-            {
-                // 31
+        }
 
-                int v1 = pcm.ram2[31][5];
-                int v2 = pcm.ram1[28][1];
+        { // global counter for envelopes
+            if (!pcm.nfs)
+                pcm.tv_counter = pcm.ram2[31][8]; // fixme
 
-                int m1 = multi(v2, v1 >> 8) >> 5;
-                int m2 = multi(v2, v1 & 255) >> 5;
+            pcm.tv_counter -= 1;
 
-                rcadd[5] = m1;
-                rcadd2[5] = m2;
+            pcm.tv_counter &= 0x3fff;
 
-                {
-                    // address generator
-
-                    int key = 1;
-                    int okey = (pcm.ram2[31][7] & 0x20) != 0;
-                    int active = key && okey;
-                    int kon = key && !okey;
-
-                    int b15 = (pcm.ram2[31][8] & 0x8000) != 0; // 0
-                    int b6 = (pcm.ram2[31][7] & 0x40) != 0; // 1
-                    int b7 = (pcm.ram2[31][7] & 0x80) != 0; // 1
-                    int old_nibble = (pcm.ram2[31][7] >> 12) & 15; // 1
-                    (void)old_nibble; // unused
-
-                    int address = pcm.ram1[31][4]; // 0
-                    int address_end = pcm.ram1[31][0]; // 1 or 2
-                    int address_loop = pcm.ram1[31][2]; // 2 or 1
-
-                    int sub_phase = (pcm.ram2[31][8] & 0x3fff); // 1
-                    int interp_ratio = (sub_phase >> 7) & 127;
-                    (void)interp_ratio; // unused
-                    sub_phase += pcm.ram2[pcm.ram2[31][7] & 31][0]; // 5
-                    int sub_phase_of = (sub_phase >> 14) & 7;
-                    if (pcm.nfs)
-                    {
-                        pcm.ram2[31][8] &= ~0x3fff;
-                        pcm.ram2[31][8] |= sub_phase & 0x3fff;
-                    }
-
-
-                    // address 0
-                    int address_cnt = address;
-
-                    int cmp1 = b15 ? address_loop : address_end;
-                    int cmp2 = address_cnt;
-                    int address_cmp = (cmp1 & 0xfffff) == (cmp2 & 0xfffff); // 9
-                    int next_b15 = b15;
-
-                    int next_address = address_cnt; // 11
-
-                    cmp1 = (!b6 && address_cmp) ? address_loop : address_cnt;
-                    cmp2 = address_cnt;
-                    int address_cnt2 = (kon || (!b6 && address_cmp)) ? cmp1 : cmp2;
-
-                    int address_add = (!address_cmp && b6 && !b15) || (!address_cmp && !b6);
-                    int address_sub = !address_cmp && b6 && b15;
-                    if (b7)
-                        address_cnt2 -= address_add - address_sub;
-                    else
-                        address_cnt2 += address_add - address_sub;
-                    address_cnt = address_cnt2 & 0xfffff; // 11
-                    b15 = b6 && (b15 ^ address_cmp); // 11
-
-                    cmp1 = b15 ? address_loop : address_end;
-                    cmp2 = address_cnt;
-                    address_cmp = (cmp1 & 0xfffff) == (cmp2 & 0xfffff); // 13
-
-                    if (sub_phase_of >= 1)
-                    {
-                        next_address = address_cnt; // 13
-                        next_b15 = b15;
-                    }
-
-                    if (active && pcm.nfs)
-                        pcm.ram1[31][4] = next_address;
-
-                    if (pcm.nfs)
-                    {
-                        pcm.ram2[31][8] &= ~0x8000;
-                        pcm.ram2[31][8] |= next_b15 << 15;
-                    }
-
-                    int t1 = address_loop; // 18
-                    int t2 = pcm.ram1[31][4] - t1; // 19
-                    int t3 = address_end - t2; // 20
-                    int t4 = pcm.ram1[31][4]; // 23
-
-                    pcm.ram2[29][10] = t3;
-                    pcm.ram2[29][11] = t4;
-                }
-            }
+            PCM_UpdateTVStep(pcm);
         }
 
+        int rcadd[6] = {};
+        int rcadd2[6] = {};
+
+        PCM_UpdateEffects(pcm, rcadd, rcadd2);
+
         pcm.ram1[31][1] = 0;
         pcm.ram1[31][3] = 0;
         pcm.rcsum[0] = 0;
         pcm.rcsum[1] = 0;
 
+        pcm_voice_lanes_t lanes;
+        pcm_slot_t slots[32];
+        int lane_count = 0;
+
         for (int slot = 0; slot < pcm.config.reg_slots; slot++)
         {
             uint32_t *ram1 = pcm.ram1[slot];
@@ -1107,6 +1405,20 @@ void PCM_Update(pcm_t& pcm, uint64_t cycles)
             int okey = (ram2[7] & 0x20) != 0;
             int key = (voice_active >> slot) & 1;
 
+            // A slot that is not keyed has its voice state cleared at the end
+            // of the mixing loop and contributes nothing to the mix, so only
+            // the filter level, which is not cleared, has to be advanced.
+            // Slot 31 always takes the full path: its filter state is the
+            // mix accumulator.
+            if (!key && pcm.nfs && slot != 31)
+            {
+                calc_tv(pcm, 2, ram2[5], &ram2[11], 0, NULL);
+                slots[slot] = {0, 0, 0, 0, 0, 0, -1};
+                continue;
+            }
+
+            const int lane = lane_count++;
+
             int active = okey && key;
             int kon = key && !okey;
 
@@ -1373,57 +1685,11 @@ void PCM_Update(pcm_t& pcm, uint64_t cycles)
 
             test = addclip20(test, step2 >> 1, step2 & 1);
 
-            int filter = ram2[11];
-            int v3;
-
-            if (pcm.mcu->is_mk1)
-            {
-                int mult1 = multi(reg1, filter >> 8); // 8
-                int mult2 = multi(reg1, (filter >> 1) & 127); // 9
-                int mult3 = multi(reg1, reg2_6); // 10
-
-                int v2 = addclip20(reg3, mult1 >> 6, (mult1 >> 5) & 1); // 9
-                int v1 = addclip20(v2, mult2 >> 13, (mult2 >> 12) & 1); // 10
-                int subvar = addclip20(v1, (mult3 >> 6), (mult3 >> 5) & 1); // 11
-
-                ram1[3] = v1;
-
-                v3 = addclip20(test, subvar ^ 0xfffff, 1); // 12
-
-                int mult4 = multi(v3, filter >> 8);
-                int mult5 = multi(v3, (filter >> 1) & 127);
-                int v4 = addclip20(reg1, mult4 >> 6, (mult4 >> 5) & 1); // 14
-                int v5 = addclip20(v4, mult5 >> 13, (mult5 >> 12) & 1); // 15
-
-                ram1[1] = v5;
-            }
-            else
-            {
-                // hack: use 32-bit math to avoid overflow
-                int mult1 = reg1 * (int8_t)(filter >> 8); // 8
-                int mult2 = reg1 * (int8_t)((filter >> 1) & 127); // 9
-                int mult3 = reg1 * (int8_t)reg2_6; // 10
-
-                int v2 = reg3 + (mult1 >> 6) + ((mult1 >> 5) & 1); // 9
-                int v1 = v2 + (mult2 >> 13) + ((mult2 >> 12) & 1); // 10
-                int subvar = v1 + (mult3 >> 6) + ((mult3 >> 5) & 1); // 11
-
-                ram1[3] = v1;
-
-                int tests = test;
-                tests <<= 12;
-                tests >>= 12;
-
-                v3 = tests - subvar; // 12
-
-                int mult4 = v3 * (int8_t)(filter >> 8);
-                int mult5 = v3 * (int8_t)((filter >> 1) & 127);
-                int v4 = reg1 + (mult4 >> 6) + ((mult4 >> 5) & 1); // 14
-                int v5 = v4 + (mult5 >> 13) + ((mult5 >> 12) & 1); // 15
-
-                ram1[1] = v5;
-            }
-
+            lanes.test[lane] = test;
+            lanes.reg1[lane] = reg1;
+            lanes.reg3[lane] = reg3;
+            lanes.reg2_6[lane] = reg2_6;
+            lanes.filter[lane] = ram2[11];
 
             ram1[5] = reference;
 
@@ -1434,7 +1700,7 @@ void PCM_Update(pcm_t& pcm, uint64_t cycles)
                     ram2[8] |= 0x4000;
                 pcm.irq_assert = 1;
                 pcm.irq_channel = slot;
-                if (pcm.mcu->is_jv880)
+                if constexpr (Model::is_jv880)
                     MCU_GA_SetGAInt(*pcm.mcu, 5, 1);
                 else
                     MCU_Interrupt_SetRequest(*pcm.mcu, INTERRUPT_SOURCE_IRQ0, 1);
@@ -1447,30 +1713,48 @@ void PCM_Update(pcm_t& pcm, uint64_t cycles)
             calc_tv(pcm, 1, ram2[4], &ram2[10], active, &volmul2);
             calc_tv(pcm, 2, ram2[5], &ram2[11], active, NULL);
 
-            // if (volmul1 && volmul2)
-            //     volmul1 += 0;
+            lanes.sel[lane] = ram2[6] & 2;
+            lanes.volmul1[lane] = volmul1;
+            lanes.volmul2[lane] = volmul2;
+            lanes.pan[lane] = active ? ram2[1] : 0;
+            lanes.rc[lane] = active ? ram2[2] : 0;
 
-            int sample = (ram2[6] & 2) == 0 ? ram1[3] : v3;
-            //sample = test;
-
-            int multiv1 = multi(sample, volmul1 >> 8);
-            int multiv2 = multi(sample, (volmul1 >> 1) & 127);
+            slots[slot] = {key, kon, active, usenew, newnibble, old_nibble, lane};
+        }
 
-            int sample2 = addclip20(multiv1 >> 6, multiv2 >> 13, ((multiv2 >> 12) | (multiv1 >> 5)) & 1);
+        // Slot 31's filter state doubles as the mix accumulator, so with all
+        // 32 slots in use its stage runs last, in the mixing loop below. It
+        // never skips, so it always occupies the last lane.
+        PCM_VoiceStage<Model::is_mk1>(lanes, pcm.config.reg_slots == 32 ? lane_count - 1 : lane_count);
 
-            int multiv3 = multi(sample2, volmul2 >> 8);
-            int multiv4 = multi(sample2, (volmul2 >> 1) & 127);
+        for (int slot = 0; slot < pcm.config.reg_slots; slot++)
+        {
+            uint32_t *ram1 = pcm.ram1[slot];
+            uint16_t *ram2 = pcm.ram2[slot];
+            const auto [key, kon, active, usenew, newnibble, old_nibble, lane] = slots[slot];
 
-            int sample3 = addclip20(multiv3 >> 6, multiv4 >> 13, ((multiv4 >> 12) | (multiv3 >> 5)) & 1);
+            if (slot == 31)
+            {
+                lanes.reg1[lane] = ram1[1];
+                lanes.reg3[lane] = ram1[3];
+                PCM_VoiceStageScalar<Model::is_mk1>(lanes, lane, lane + 1);
+            }
 
-            int pan = active ? ram2[1] : 0;
-            int rc = active ? ram2[2] : 0;
+            int sampl = 0;
+            int sampr = 0;
+            int rc0 = 0;
+            int rc1 = 0;
 
-            int sampl = multi(sample3, (pan >> 8) & 255);
-            int sampr = multi(sample3, (pan >> 0) & 255);
+            if (lane >= 0)
+            {
+                ram1[3] = lanes.v1[lane];
+                ram1[1] = lanes.v5[lane];
 
-            int rc0 = multi(sample3, (rc >> 8) & 255) >> 5; // reverb
-            int rc1 = multi(sample3, (rc >> 0) & 255) >> 5; // chorus
+                sampl = lanes.sampl[lane];
+                sampr = lanes.sampr[lane];
+                rc0 = lanes.rc0[lane];
+                rc1 = lanes.rc1[lane];
+            }
 
             // mix reverb/chorus?
             int slot2 = (slot == pcm.config.reg_slots - 1) ? 31 : slot + 1;
@@ -1570,10 +1854,22 @@ void PCM_Update(pcm_t& pcm, uint64_t cycles)
 
         int new_cycles = (pcm.config.reg_slots + 1) * 25;
 
-        pcm.cycles += pcm.mcu->is_jv880 ? (new_cycles * 25) / 29 : new_cycles;
+        pcm.cycles += Model::is_jv880 ? (new_cycles * 25) / 29 : new_cycles;
     }
 }
 
+template void PCM_UpdateModel<mcu_model_mk2_t>(pcm_t& pcm, uint64_t cycles);
+template void PCM_UpdateModel<mcu_model_mk1_t>(pcm_t& pcm, uint64_t cycles);
+template void PCM_UpdateModel<mcu_model_jv880_t>(pcm_t& pcm, uint64_t cycles);
+template void PCM_UpdateModel<mcu_model_scb55_t>(pcm_t& pcm, uint64_t cycles);
+
+void PCM_Update(pcm_t& pcm, uint64_t cycles)
+{
+    MCU_WithModel(*pcm.mcu, [&](auto model) {
+        PCM_UpdateModel<decltype(model)>(pcm, cycles);
+    });
+}
+
 uint32_t PCM_GetOutputFrequency(const pcm_t& pcm)
 {
     uint32_t freq = (pcm.mcu->is_mk1 || pcm.mcu->is_jv880) ? 64000 : 66207;
@@ -1586,3 +1882,9 @@ uint32_t PCM_GetOutputFrequency(const pcm_t& pcm)
         return freq;
     }
 }
+
+void PCM_GetOutputFrequencyRatio(const pcm_t& pcm, uint32_t& num, uint32_t& den)
+{
+    num = (pcm.mcu->is_mk1 || pcm.mcu->is_jv880) ? 64000 : 66207;
+    den = pcm.disable_oversampling ? 2 : 1;
+}
@@ -51,6 +51,13 @@ struct PCM_Config
     int reg_slots = 1;
 };
 
+// Wave ROM bank as seen by the voice address generator
+struct pcm_rom_bank_t
+{
+    const uint8_t* base = nullptr;
+    uint32_t mask = 0;
+};
+
 struct pcm_t {
     uint32_t ram1[32][8]{};
     uint16_t ram2[32][16]{};
@@ -64,6 +71,10 @@ struct pcm_t {
     uint32_t read_latch = 0;
     uint8_t config_reg_3c = 0; // SC55:c3 JV880:c0
     uint8_t config_reg_3d = 0;
+    // Wave ROM address bits 19-21, or 21-23 if config_reg_3d bit 5 is set,
+    // select one of these banks. Rebuilt by PCM_UpdateROMBanks.
+    pcm_rom_bank_t rom_banks[8]{};
+    uint8_t rom_bank_shift = 19;
     uint32_t irq_channel = 0;
     uint32_t irq_assert = 0;
     PCM_Config config{};
@@ -71,6 +82,8 @@ struct pcm_t {
     uint32_t nfs = 0;
 
     uint32_t tv_counter = 0;
+    // Per envelope rate, see PCM_UpdateTVStep
+    uint8_t tv_step[8]{};
 
     uint64_t cycles = 0;
 
@@ -94,6 +107,14 @@ struct pcm_t {
 void PCM_Write(pcm_t& pcm, uint32_t address, uint8_t data);
 uint8_t PCM_Read(pcm_t& pcm, uint32_t address);
 void PCM_Init(pcm_t& pcm, mcu_t& mcu);
+// Rebuilds pcm.rom_banks. Must be called after the romset flags change.
+void PCM_UpdateROMBanks(pcm_t& pcm);
 void PCM_Update(pcm_t& pcm, uint64_t cycles);
+// PCM_Update for a fixed mcu_model_t
+template <typename Model>
+void PCM_UpdateModel(pcm_t& pcm, uint64_t cycles);
 uint32_t PCM_GetOutputFrequency(const pcm_t& pcm);
+// Exact output frequency as num / den Hz. PCM_GetOutputFrequency rounds the
+// mk2's native rate of 66207 / 2 Hz down.
+void PCM_GetOutputFrequencyRatio(const pcm_t& pcm, uint32_t& num, uint32_t& den);
 void PCM_GetConfig(PCM_Config& config, uint8_t config_byte);
@@ -35,6 +35,7 @@
 
 #include "audio.h"
 #include "math_util.h"
+#include <algorithm>
 #include <memory>
 #include <span>
 
@@ -134,6 +135,37 @@ public:
         m_read_head = (m_read_head + 1) % m_elem_count;
     }
 
+    // Writes all of `values`, which must fit in GetWritableCount().
+    void UncheckedWrite(std::span<const ElemT> values)
+    {
+        const size_t first_count = Min(values.size(), m_elem_count - m_write_head);
+        std::copy_n(values.data(), first_count, GetWritePtr());
+        std::copy(values.begin() + first_count, values.end(), (ElemT*)m_buffer.data());
+        m_write_head = (m_write_head + values.size()) % m_elem_count;
+    }
+
+    // Readable elements that are contiguous in memory, starting at the read
+    // head. If the readable range wraps around, this is only its first part.
+    std::span<const ElemT> GetReadableSpan() const
+    {
+        const size_t count = (m_read_head <= m_write_head) ? m_write_head - m_read_head
+                                                           : m_elem_count - m_read_head;
+        return {GetReadPtr(), count};
+    }
+
+    // Returns the readable element `offset` places after the read head
+    // without consuming anything.
+    const ElemT& UncheckedPeek(size_t offset) const
+    {
+        return ((const ElemT*)m_buffer.data())[(m_read_head + offset) % m_elem_count];
+    }
+
+    // Consumes `count` elements, which must not exceed GetReadableCount().
+    void UncheckedSkip(size_t count)
+    {
+        m_read_head = (m_read_head + count) % m_elem_count;
+    }
+
     size_t GetReadableCount() const
     {
         if (m_read_head <= m_write_head)
@@ -33,6 +33,7 @@
  */
 #include "submcu.h"
 #include "mcu.h"
+#include <algorithm>
 
 enum {
     SM_VECTOR_UART3_TX = 0,
@@ -1388,29 +1389,54 @@ void SM_HandleInterrupt(submcu_t& sm)
     }
 }
 
+// The timer ticks every 16 cycles. Each tick the prescaler counts down; when
+// it underflows it reloads and the counter counts down instead, raising the
+// timer X request when that underflows as well. The ticks elapsed since the
+// last update are applied in one go.
 void SM_UpdateTimer(submcu_t& sm)
 {
-    while (sm.timer_cycles < sm.cycles)
+    if (sm.timer_cycles >= sm.cycles)
+        return;
+
+    const uint64_t ticks = (sm.cycles - sm.timer_cycles + 15) / 16;
+    sm.timer_cycles += ticks * 16;
+
+    if ((sm.device_mode[SM_DEV_TIMER_CTRL] & 0x20) != 0 || sm.sleep)
+        return;
+
+    if (ticks <= sm.timer_prescaler)
     {
-        if ((sm.device_mode[SM_DEV_TIMER_CTRL] & 0x20) == 0 && !sm.sleep)
-        {
-            if (sm.timer_prescaler == 0)
-            {
-                sm.timer_prescaler = sm.device_mode[SM_DEV_PRESCALER];
-
-                if (sm.timer_counter == 0)
-                {
-                    sm.timer_counter = sm.device_mode[SM_DEV_TIMER];
-                    sm.device_mode[SM_DEV_INT_REQUEST] |= 0x8;
-                }
-                else
-                    sm.timer_counter--;
-            }
-            else
-                sm.timer_prescaler--;
-        }
-        sm.timer_cycles += 16;
+        sm.timer_prescaler -= ticks;
+        return;
+    }
+
+    const uint64_t prescale = sm.device_mode[SM_DEV_PRESCALER] + 1;
+    const uint64_t underflows = 1 + (ticks - sm.timer_prescaler - 1) / prescale;
+    sm.timer_prescaler = sm.device_mode[SM_DEV_PRESCALER]
+        - (ticks - sm.timer_prescaler - 1) % prescale;
+
+    if (underflows <= sm.timer_counter)
+    {
+        sm.timer_counter -= underflows;
+        return;
     }
+
+    const uint64_t period = sm.device_mode[SM_DEV_TIMER] + 1;
+    sm.timer_counter = sm.device_mode[SM_DEV_TIMER]
+        - (underflows - sm.timer_counter - 1) % period;
+    sm.device_mode[SM_DEV_INT_REQUEST] |= 0x8;
+}
+
+// First value of sm.cycles at which SM_UpdateTimer raises the timer X request
+static uint64_t SM_NextTimerEvent(const submcu_t& sm)
+{
+    if ((sm.device_mode[SM_DEV_TIMER_CTRL] & 0x20) != 0 || sm.sleep)
+        return UINT64_MAX;
+
+    const uint64_t prescale = sm.device_mode[SM_DEV_PRESCALER] + 1;
+    const uint64_t tick = sm.timer_prescaler + sm.timer_counter * prescale;
+
+    return sm.timer_cycles + tick * 16 + 1;
 }
 
 void SM_UpdateUART(submcu_t& sm)
@@ -1436,22 +1462,126 @@ void SM_UpdateUART(submcu_t& sm)
     mcu.uart_rx_delay = sm.cycles + 3000 * 4;
 }
 
-void SM_Update(submcu_t& sm, uint64_t cycles)
+// True if the instruction just executed at `pc` was a BBC/BBS that branched
+// to itself on a bit that can only change through an interrupt, a UART byte
+// or the main MCU
+static bool SM_IsPollingLoop(submcu_t& sm, uint8_t opcode, uint16_t pc)
 {
-    while (sm.cycles < cycles * 5)
+    if ((opcode & 0x0b) != 0x03 || sm.pc != pc)
+        return false;
+
+    if ((opcode & 4) == 0) // tests the accumulator
+        return true;
+
+    const uint8_t address = SM_Read(sm, pc + 1);
+    if (address < 0x80 || (address >= 0xc0 && address < 0xd8))
+        return true;
+    if (address < 0xe0)
+        return false;
+
+    switch (address & 0x1f)
     {
-        SM_HandleInterrupt(sm);
+        case SM_DEV_UART2_DATA:
+        case SM_DEV_P1_DATA:
+        case SM_DEV_PRESCALER:
+        case SM_DEV_TIMER:
+            return false;
+    }
+    return true;
+}
 
-        if (!sm.sleep)
-        {
-            uint8_t opcode = SM_ReadAdvance(sm);
+// Skips the steps that would repeat the current one unchanged: all of them up
+// to `end` except the last, or up to the step that receives the next UART byte
+// or raises the timer request.
+static void SM_SkipIdle(submcu_t& sm, uint64_t end)
+{
+    const mcu_t& mcu = *sm.mcu;
+    uint64_t limit = end;
 
-            SM_Opcode_Table[opcode](sm, opcode);
-        }
+    if ((sm.device_mode[SM_DEV_UART1_CTRL] & 4) != 0
+        && mcu.uart_write_ptr != mcu.uart_read_ptr && !sm.uart_rx_gotbyte)
+        limit = std::min(limit, mcu.uart_rx_delay);
 
-        sm.cycles += 12 * 4; // FIXME
+    limit = std::min(limit, SM_NextTimerEvent(sm));
 
-        SM_UpdateTimer(sm);
-        SM_UpdateUART(sm);
+    if (limit <= sm.cycles)
+        return;
+
+    const uint64_t steps = (limit - sm.cycles + 12 * 4 - 1) / (12 * 4) - 1;
+    if (steps == 0)
+        return;
+
+    sm.cycles += steps * 12 * 4;
+    SM_UpdateTimer(sm);
+    sm.idle_cycles_skipped += steps * 12 * 4;
+}
+
+// Runs one instruction or sleep period, then whatever idle steps follow it
+// before `end`
+static inline void SM_Step(submcu_t& sm, uint64_t end)
+{
+    SM_HandleInterrupt(sm);
+
+    const uint16_t pc = sm.pc;
+    const bool asleep = sm.sleep;
+    uint8_t opcode = 0;
+
+    if (!asleep)
+    {
+        opcode = SM_ReadAdvance(sm);
+
+        SM_Opcode_Table[opcode](sm, opcode);
+    }
+
+    sm.cycles += 12 * 4; // FIXME
+
+    const uint8_t int_request = sm.device_mode[SM_DEV_INT_REQUEST];
+    const uint8_t uart_rx_gotbyte = sm.uart_rx_gotbyte;
+
+    SM_UpdateTimer(sm);
+    SM_UpdateUART(sm);
+
+    // Asleep without an interrupt to wake up to, or spinning on a flag:
+    // until a timer or UART request comes in, every step is the same
+    if (int_request == sm.device_mode[SM_DEV_INT_REQUEST]
+        && uart_rx_gotbyte == sm.uart_rx_gotbyte
+        && (asleep || SM_IsPollingLoop(sm, opcode, pc)))
+        SM_SkipIdle(sm, end);
+}
+
+void SM_Update(submcu_t& sm, uint64_t cycles)
+{
+    const uint64_t end = cycles * 5;
+
+    while (sm.cycles < end)
+        SM_Step(sm, end);
+}
+
+// While the main MCU sleeps or spins in an idle loop nothing it does reaches
+// the sub MCU, and the only thing that can change that before its next
+// peripheral event is an interrupt from the sub MCU. So instead of one
+// SM_Update per main MCU step, the sub MCU runs on its own up to the last step
+// before `event`, checking after each instruction whether the main MCU would
+// now take an interrupt. If it would, the main MCU step that instruction
+// belongs to is finished and returned; otherwise the last step is.
+uint64_t SM_UpdateUntilInterrupt(submcu_t& sm, uint64_t cycles, uint64_t event)
+{
+    const mcu_t& mcu = *sm.mcu;
+    const uint32_t mask = (mcu.sr >> 8) & 7;
+    const uint64_t last = cycles + (event - cycles - 1) / 12 * 12;
+    const uint64_t end = last * 5;
+
+    while (sm.cycles < end)
+    {
+        const uint64_t start = sm.cycles;
+        SM_Step(sm, end);
+
+        if (mcu.interrupt_level > mask)
+        {
+            const uint64_t step = cycles + ((start - cycles * 5) / (12 * 5) + 1) * 12;
+            SM_Update(sm, step);
+            return step;
+        }
     }
+    return last;
 }
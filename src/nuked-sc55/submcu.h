@@ -74,11 +74,15 @@ struct submcu_t {
     uint8_t timer_counter = 0;
 
     uint8_t uart_rx_gotbyte = 0;
+
+    // Cycles fast-forwarded while asleep or spinning on a flag
+    uint64_t idle_cycles_skipped = 0;
 };
 
 void SM_Init(submcu_t& sm, mcu_t& mcu);
 void SM_Reset(submcu_t& sm);
 void SM_Update(submcu_t& sm, uint64_t cycles);
+uint64_t SM_UpdateUntilInterrupt(submcu_t& sm, uint64_t cycles, uint64_t event);
 void SM_SysWrite(submcu_t& sm, uint32_t address, uint8_t data);
 uint8_t SM_SysRead(submcu_t& sm, uint32_t address);
 void SM_PostUART(submcu_t& sm, uint8_t data);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -52,6 +53,9 @@ static void log_shutdown() {}
 
 extern const char* plugin_path;
 
+// Headroom in the sample sink for frames rendered past the requested count
+constexpr size_t SinkSlack = 64;
+
 NukedSc55::NukedSc55(const clap_plugin_t _plugin_class,
                      const clap_host_t* _host, const Model _model)
 {
@@ -140,6 +144,18 @@ void NukedSc55::Shutdown()
 {
     log("Shutdown");
 
+    if (emu) {
+        log("Idle loop cycles skipped: %llu of %llu",
+            (unsigned long long)emu->GetMCU().idle_cycles_skipped,
+            (unsigned long long)emu->GetMCU().cycles);
+
+        if (model == Model::Sc55mk2_v1_01) {
+            log("Sub-MCU idle cycles skipped: %llu of %llu",
+                (unsigned long long)emu->GetMCU().sm->idle_cycles_skipped,
+                (unsigned long long)emu->GetMCU().sm->cycles);
+        }
+    }
+
     if (resampler) {
         speex_resampler_destroy(resampler);
         resampler = nullptr;
@@ -168,62 +184,127 @@ bool NukedSc55::Activate(const double requested_sample_rate,
         max_frame_count);
 
     emu->Reset();
+#ifdef NUKED_SC55_OVERSAMPLED_OUTPUT
+    // Keep the chip's native 2x oversampled output; it gets decimated or
+    // resampled to the host rate below
+    emu->GetPCM().disable_oversampling = false;
+#else
     emu->GetPCM().disable_oversampling = true;
+#endif
     emu->PostSystemReset(EMU_SystemReset::GS_RESET);
 
     // Speed up the devices' bootup delay
-    const size_t num_steps = (model == Model::Sc55mk2_v1_01) ? 9'500'000 : 700'000;
+    const uint64_t num_steps = (model == Model::Sc55mk2_v1_01) ? 9'500'000 : 700'000;
 
-    for (size_t i = 0; i < num_steps; i++) {
-        MCU_Step(emu->GetMCU());
+    // A single MCU_Run can cover many instructions, so run for the
+    // equivalent number of cycles (12 per step)
+    auto& mcu = emu->GetMCU();
+    const uint64_t boot_end_cycles = mcu.cycles + num_steps * 12;
+
+    while (mcu.cycles < boot_end_cycles) {
+        MCU_Run(mcu);
     }
 
     emu->SetSampleCallback(receive_sample, this);
 
-    render_sample_rate_hz = PCM_GetOutputFrequency(emu->GetPCM());
+    // The mk2's native rate is 33103.5 Hz, so keep it as a fraction
+    uint32_t render_rate_num = 0;
+    uint32_t render_rate_den = 0;
+    PCM_GetOutputFrequencyRatio(emu->GetPCM(), render_rate_num, render_rate_den);
+
+#ifdef NUKED_SC55_OVERSAMPLED_OUTPUT
+    // Below the native rate, the half-band filter takes care of the top
+    // octave and the resampler only has to bridge the remaining ratio. From
+    // the native rate up the oversampled stream is resampled directly.
+    do_decimate = requested_sample_rate * render_rate_den < render_rate_num;
+    if (do_decimate) {
+        render_rate_den *= 2;
+        decimator.Reset();
+    }
+#endif
+
+    render_sample_rate_hz = static_cast<double>(render_rate_num) / render_rate_den;
 
     log("render_sample_rate_hz: %g", render_sample_rate_hz);
 
+    if (resampler) {
+        speex_resampler_destroy(resampler);
+        resampler = nullptr;
+    }
+
     if (requested_sample_rate != render_sample_rate_hz) {
         do_resample = true;
 
         output_sample_rate_hz = requested_sample_rate;
 
-        // Initialise Speex resampler
         resample_ratio = render_sample_rate_hz / output_sample_rate_hz;
 
-        const spx_uint32_t in_rate_hz = static_cast<int>(render_sample_rate_hz);
-        const spx_uint32_t out_rate_hz = static_cast<int>(output_sample_rate_hz);
+        const auto out_rate_hz = static_cast<uint32_t>(output_sample_rate_hz);
 
-        constexpr auto NumChannels     = 2; // always stereo
-        constexpr auto ResampleQuality = SPEEX_RESAMPLER_QUALITY_DESKTOP;
+        // Upsampling to the usual host rates goes through the polyphase
+        // resampler; Speex covers everything else
+        use_polyphase = (out_rate_hz == output_sample_rate_hz) &&
+                        polyphase_resampler.Init(render_rate_num,
+                                                 render_rate_den,
+                                                 out_rate_hz);
 
-        resampler = speex_resampler_init(
-            NumChannels, in_rate_hz, out_rate_hz, ResampleQuality, nullptr);
+        if (!use_polyphase) {
+            // Initialise Speex resampler with the exact ratio
+            const auto in_rate_hz = static_cast<spx_uint32_t>(render_sample_rate_hz);
 
-        speex_resampler_set_rate(resampler, in_rate_hz, out_rate_hz);
-        speex_resampler_skip_zeros(resampler);
+            constexpr auto NumChannels     = 2; // always stereo
+            constexpr auto ResampleQuality = SPEEX_RESAMPLER_QUALITY_DESKTOP;
 
-        const auto max_render_buf_size = static_cast<size_t>(
-            static_cast<double>(max_frame_count) * resample_ratio * 1.10f);
+            resampler = speex_resampler_init_frac(NumChannels,
+                                                  render_rate_num,
+                                                  render_rate_den * out_rate_hz,
+                                                  in_rate_hz,
+                                                  out_rate_hz,
+                                                  ResampleQuality,
+                                                  nullptr);
 
-        render_buf[0].reserve(max_render_buf_size);
-        render_buf[1].reserve(max_render_buf_size);
+            speex_resampler_skip_zeros(resampler);
+        }
 
     } else {
-        do_resample = false;
+        do_resample   = false;
+        use_polyphase = false;
 
         output_sample_rate_hz = render_sample_rate_hz;
         resample_ratio        = 1.0;
-
-        render_buf[0].reserve(max_frame_count);
-        render_buf[1].reserve(max_frame_count);
     }
 
     log("do_resample: %s", do_resample ? "true" : "false");
+    log("use_polyphase: %s", use_polyphase ? "true" : "false");
     log("output_sample_rate_hz: %g", output_sample_rate_hz);
     log("resample_ratio: %g", resample_ratio);
 
+    // Enough for the largest RenderAudio call (twice that before the
+    // decimator), plus room for the few frames the last MCU_Run of a block
+    // can overshoot by
+    const auto max_render_frames = static_cast<size_t>(
+        std::ceil(static_cast<double>(max_frame_count) * resample_ratio * 1.10));
+
+    const auto sink_size = max_render_frames * (do_decimate ? 2 : 1) + SinkSlack;
+
+    sink_frames.resize(sink_size);
+    sink_planar[0].resize(sink_size);
+    sink_planar[1].resize(sink_size);
+
+    // Room for a block's worth of frames on top of what the previous block
+    // left over; one slot of a ring always stays empty
+    const auto render_buf_size = (max_render_frames + SinkSlack) * 2 + 1;
+
+    for (size_t ch = 0; ch < render_buf.size(); ++ch) {
+        render_mem[ch].Free();
+
+        if (!render_mem[ch].Init(render_buf_size * sizeof(float))) {
+            log("Failed to allocate the render buffer");
+            return false;
+        }
+        render_buf[ch] = RingbufferView<float>(render_mem[ch]);
+    }
+
     return true;
 }
 
@@ -263,10 +344,11 @@ clap_process_status NukedSc55::Process(const clap_process_t* process)
             }
         }
 
-        const auto num_frames_to_render = static_cast<int>(
-            static_cast<double>(next_event_frame - curr_frame) * resample_ratio);
+        // Render samples until the next event. Frames left over from the
+        // previous block come first, so they count towards this.
+        const auto num_frames_to_render = static_cast<size_t>(
+            static_cast<double>(next_event_frame) * resample_ratio);
 
-        // Render samples until the next event
         RenderAudio(num_frames_to_render);
 
         curr_frame = next_event_frame;
@@ -280,11 +362,8 @@ clap_process_status NukedSc55::Process(const clap_process_t* process)
 
     } else {
         for (size_t i = 0; i < num_frames; ++i) {
-            out_left[i]  = render_buf[0][i];
-            out_right[i] = render_buf[1][i];
-
-            render_buf[0].clear();
-            render_buf[1].clear();
+            render_buf[0].UncheckedReadOne(out_left[i]);
+            render_buf[1].UncheckedReadOne(out_right[i]);
         }
     }
 
@@ -329,8 +408,37 @@ void NukedSc55::Flush(const clap_input_events_t* in, const clap_output_events_t*
 
 void NukedSc55::PublishFrame(const float left, const float right)
 {
-    render_buf[0].emplace_back(left);
-    render_buf[1].emplace_back(right);
+    if (do_decimate) {
+        float out_left  = 0.0f;
+        float out_right = 0.0f;
+
+        if (decimator.Process(left, right, out_left, out_right)) {
+            render_buf[0].UncheckedWriteOne(out_left);
+            render_buf[1].UncheckedWriteOne(out_right);
+        }
+        return;
+    }
+
+    render_buf[0].UncheckedWriteOne(left);
+    render_buf[1].UncheckedWriteOne(right);
+}
+
+void NukedSc55::PublishSinkFrames(const size_t num_frames)
+{
+    auto left  = sink_planar[0].data();
+    auto right = sink_planar[1].data();
+
+    NormalizePlanar(std::span(sink_frames).first(num_frames), left, right);
+
+    if (do_decimate) {
+        for (size_t i = 0; i < num_frames; ++i) {
+            PublishFrame(left[i], right[i]);
+        }
+        return;
+    }
+
+    render_buf[0].UncheckedWrite(std::span(left, num_frames));
+    render_buf[1].UncheckedWrite(std::span(right, num_frames));
 }
 
 constexpr uint8_t NoteOff         = 0x80;
@@ -420,17 +528,36 @@ void NukedSc55::ProcessEvent(const clap_event_header_t* event)
     }
 }
 
-void NukedSc55::RenderAudio(const uint32_t num_frames)
+void NukedSc55::RenderAudio(const size_t num_frames)
 {
-    const auto start_size = render_buf[0].size();
+    [[maybe_unused]] const auto start_size = render_buf[0].GetReadableCount();
 
     log("RenderAudio: num_frames: %d, start_size: %d", num_frames, start_size);
 
-    while (render_buf[0].size() - start_size < num_frames) {
-        MCU_Step(emu->GetMCU());
+    auto& mcu = emu->GetMCU();
+
+    while (render_buf[0].GetReadableCount() < num_frames) {
+        const auto num_remaining = num_frames - render_buf[0].GetReadableCount();
+
+        // The decimator consumes two chip frames per output frame
+        const auto num_chip_frames = std::min(do_decimate ? num_remaining * 2
+                                                          : num_remaining,
+                                              sink_frames.size() - SinkSlack);
+
+        emu->SetSampleSink(sink_frames);
+
+        while (emu->GetSampleSinkCount() < num_chip_frames) {
+            MCU_Run(mcu);
+        }
+
+        assert(render_buf[0].GetWritableCount() >= emu->GetSampleSinkCount());
+
+        PublishSinkFrames(emu->GetSampleSinkCount());
     }
 
-    log("  num_rendered: %d", render_buf[0].size() - start_size);
+    emu->SetSampleSink({});
+
+    log("  num_rendered: %d", render_buf[0].GetReadableCount() - start_size);
 }
 
 void NukedSc55::ResampleAndPublishFrames(const uint32_t num_out_frames,
@@ -438,87 +565,63 @@ void NukedSc55::ResampleAndPublishFrames(const uint32_t num_out_frames,
 {
     log("RenderAndPublishFrames: num_out_frames: %d", num_out_frames);
 
-    const auto input_len  = render_buf[0].size();
-    const auto output_len = num_out_frames;
+    size_t out_pos = 0;
 
-    log("  input_len: %d", input_len);
+    while (out_pos < num_out_frames) {
+        const auto num_out_frames_remaining = num_out_frames - out_pos;
 
-    spx_uint32_t in_len  = input_len;
-    spx_uint32_t out_len = output_len;
+        if (render_buf[0].GetReadableCount() == 0) {
+            // "It's the only way to be sure"
+            const auto render_frame_count = static_cast<size_t>(std::ceil(
+                static_cast<double>(num_out_frames_remaining) * resample_ratio));
 
-    speex_resampler_process_float(
-        resampler, 0, render_buf[0].data(), &in_len, out_left, &out_len);
+            RenderAudio(render_frame_count);
+        }
 
-    in_len  = input_len;
-    out_len = output_len;
+        // The channels are always written together, so both rings have the
+        // same layout. If the readable frames wrap around the end of the
+        // ring, the rest is picked up on the next iteration.
+        const auto left  = render_buf[0].GetReadableSpan();
+        const auto right = render_buf[1].GetReadableSpan();
 
-    speex_resampler_process_float(
-        resampler, 1, render_buf[1].data(), &in_len, out_right, &out_len);
+        log("  input_len: %d", left.size());
 
-    // Speex returns the number actually consumed and written samples in
-    // `in_len` and `out_len`, respectively. There are three outcomes:
-    //
-    // 1) The input buffer hasn't been fully consumed, but the output buffer
-    //    has been completely filled.
-    //
-    // 2) The output buffer hasn't been filled completely, but all input
-    //    samples have been consumed.
-    //
-    // 3) All input samples have been consumed and the output buffer has been
-    //    completely filled.
-    //
-    if (out_len < output_len) {
-        // Case 2: The output buffer hasn't been filled completely; we need to
-        // generate more input samples.
-        //
-        const auto num_out_frames_remaining = output_len - out_len;
-        const auto curr_out_pos             = out_len;
+        if (use_polyphase) {
+            // Both channels in one pass
+            size_t in_len  = left.size();
+            size_t out_len = num_out_frames_remaining;
 
-        // "It's the only way to be sure"
-        const auto render_frame_count = static_cast<int>(std::ceil(
-            static_cast<double>(num_out_frames_remaining) * resample_ratio));
+            polyphase_resampler.Process(left.data(),
+                                        right.data(),
+                                        in_len,
+                                        out_left + out_pos,
+                                        out_right + out_pos,
+                                        out_len);
 
-        render_buf[0].clear();
-        render_buf[1].clear();
+            render_buf[0].UncheckedSkip(in_len);
+            render_buf[1].UncheckedSkip(in_len);
 
-        RenderAudio(render_frame_count);
+            out_pos += out_len;
+            continue;
+        }
 
-        in_len  = render_buf[0].size();
-        out_len = num_out_frames_remaining;
+        // Speex returns the number of actually consumed and written samples
+        // in `in_len` and `out_len`, respectively
+        spx_uint32_t in_len  = left.size();
+        spx_uint32_t out_len = num_out_frames_remaining;
 
-        speex_resampler_process_float(resampler,
-                                      0,
-                                      render_buf[0].data(),
-                                      &in_len,
-                                      out_left + curr_out_pos,
-                                      &out_len);
+        speex_resampler_process_float(
+            resampler, 0, left.data(), &in_len, out_left + out_pos, &out_len);
 
-        in_len  = render_buf[1].size();
+        in_len  = right.size();
         out_len = num_out_frames_remaining;
 
-        speex_resampler_process_float(resampler,
-                                      1,
-                                      render_buf[1].data(),
-                                      &in_len,
-                                      out_right + curr_out_pos,
-                                      &out_len);
-    }
+        speex_resampler_process_float(
+            resampler, 1, right.data(), &in_len, out_right + out_pos, &out_len);
 
-    if (in_len < input_len) {
-        // Case 1: The input buffer hasn't been fully consumed; we have
-        // leftover input samples that we need to keep for the next Process()
-        // call.
-        //
-        if (in_len > 0) {
-            render_buf[0].erase(render_buf[0].begin(), render_buf[0].begin() + in_len);
-            render_buf[1].erase(render_buf[1].begin(), render_buf[1].begin() + in_len);
-        }
+        render_buf[0].UncheckedSkip(in_len);
+        render_buf[1].UncheckedSkip(in_len);
 
-    } else {
-        // Case 3: All input samples have been consumed and the output buffer
-        // has been completely filled.
-        //
-        render_buf[0].clear();
-        render_buf[1].clear();
+        out_pos += out_len;
     }
 }
@@ -6,7 +6,10 @@
 #include <vector>
 
 #include "clap/clap.h"
+#include "halfband_decimator.h"
 #include "nuked-sc55/emu.h"
+#include "nuked-sc55/ringbuffer.h"
+#include "polyphase_resampler.h"
 #include "speex/speex_resampler.h"
 
 class NukedSc55 {
@@ -50,7 +53,23 @@ private:
     double render_sample_rate_hz = 0.0;
     double output_sample_rate_hz = 0.0;
 
-    std::array<std::vector<float>, 2> render_buf = {};
+    // Rendered frames waiting to be resampled or copied out, one ring per
+    // channel. Allocated in Activate so Process never touches the heap.
+    std::array<GenericBuffer, 2> render_mem = {};
+    std::array<RingbufferView<float>, 2> render_buf = {};
+
+    // RenderAudio has the emulator write its frames here directly, then
+    // converts them to planar floats in one pass
+    std::vector<AudioFrame<int32_t>> sink_frames = {};
+    std::array<std::vector<float>, 2> sink_planar = {};
+
+    // Set when the chip's oversampled output is halved before resampling
+    HalfBandDecimator decimator = {};
+    bool do_decimate            = false;
+
+    // Used for upsampling to whole-number rates, Speex for the rest
+    PolyphaseResampler polyphase_resampler = {};
+    bool use_polyphase                     = false;
 
     SpeexResamplerState* resampler = nullptr;
     bool do_resample               = false;
@@ -61,7 +80,10 @@ private:
 
     void ProcessEvent(const clap_event_header_t* event);
 
-    void RenderAudio(const uint32_t num_frames);
+    // Renders until at least `num_frames` frames are buffered
+    void RenderAudio(const size_t num_frames);
+
+    void PublishSinkFrames(const size_t num_frames);
 
     void ResampleAndPublishFrames(const uint32_t num_out_frames,
                                   float* out_left, float* out_right);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Upsamples a stereo stream by a fixed rational ratio with a windowed-sinc
+// polyphase FIR filter. The position between input frames is tracked as an
+// exact fraction, so non-integer rates like the mk2's 33103.5 Hz don't
+// drift. Both channels are filtered together in one pass.
+class PolyphaseResampler {
+public:
+    // Filter length in input frames
+    static constexpr size_t NumTaps = 64;
+
+    // Ratios that need more phases than this get a table of this many and
+    // interpolate between neighbouring phases
+    static constexpr uint32_t MaxPhases = 512;
+
+    // Sets up the filter for an input rate of `in_rate_num / in_rate_den` Hz.
+    // Returns false if the ratio is not supported, i.e. when downsampling.
+    bool Init(const uint32_t in_rate_num, const uint32_t in_rate_den,
+              const uint32_t out_rate);
+
+    void Reset();
+
+    // Reads up to `in_len` frames and writes up to `out_len` frames, like
+    // Speex. On return `in_len` and `out_len` hold the number of frames
+    // actually consumed and written.
+    void Process(const float* in_left, const float* in_right, size_t& in_len,
+                 float* out_left, float* out_right, size_t& out_len);
+
+private:
+    // Each output frame advances the input by `step / num_positions` frames
+    uint32_t step          = 0;
+    uint32_t num_positions = 0;
+    uint32_t position      = 0;
+
+    // Input frames to read before the next output frame
+    size_t num_pending = 0;
+
+    // NumTaps coefficients per phase, plus one extra phase at the far end to
+    // interpolate towards
+    std::vector<float> coeffs = {};
+    uint32_t num_phases       = 0;
+
+    // The last NumTaps input frames as interleaved L/R pairs. Stored twice so
+    // they are always contiguous.
+    alignas(16) std::array<float, NumTaps * 2 * 2> hist = {};
+    size_t hist_pos = 0;
+};